@@ -0,0 +1,455 @@
+/*
+ * The interpreting engines, instantiated once per cell width: include
+ * with CELL defined as the cell type and CELL_FN(name) as the name of
+ * each function for that width. Every tape access goes through CELL, so
+ * each instance is as specialized as a hand-written one and the 8 bit
+ * one compiles to what it always did. No include guard on purpose.
+ *
+ * tape_size is in bytes, the cell pointer (ptr_off, ptr) counts cells.
+ */
+
+#if !defined(CELL) || !defined(CELL_FN)
+#error "define CELL and CELL_FN before including bf_engines.h"
+#endif
+
+/* Not an opcode: the handler of threaded_body that threads code */
+#ifndef BF_THREAD
+#define BF_THREAD (BF_CLEAR + 1)
+#endif
+
+/*
+ * Direct-threaded interpreter. The code must have gone through
+ * thread_code first, which bf_compile does once: runs then dispatch with
+ * a single load + indirect jump and the operand in the same 16 byte slot.
+ *
+ * Handler addresses only exist inside the function that holds the
+ * labels, so the threading pass is one more handler of it, BF_THREAD.
+ * Both entry points below go in through the table with the opcode to
+ * start at, entry, and no test of their own.
+ */
+static int CELL_FN(threaded_body)(struct bf_insn *code, uintptr_t entry, unsigned char *tape,
+                                  size_t tape_size, size_t ptr_off, uint32_t pc,
+                                  const struct bf_io *io) {
+  CELL *cells = (CELL *)tape;
+  size_t ncells = tape_size / sizeof(CELL);
+  CELL *ptr = cells + ptr_off;
+  struct bf_insn *ip = code + pc;
+
+  static void *cmds[] = {
+    &&halt, &&right, &&left, &&inc, &&dec, &&out, &&in, &&open, &&close,
+    &&clear, &&thread
+  };
+
+  goto *cmds[entry];
+
+  while(1) {
+    right:
+      if ((size_t)(ptr - cells) + ip->arg >= ncells)
+        return BF_ERR_TAPE_OVERFLOW;
+      ptr += ip->arg;
+      ip++;
+      goto *ip->handler;
+
+    left:
+      if ((intptr_t)(ptr - cells) < ip->arg)
+        return BF_ERR_TAPE_UNDERFLOW;
+      ptr -= ip->arg;
+      ip++;
+      goto *ip->handler;
+
+    inc:
+      *ptr += ip->arg;
+      ip++;
+      goto *ip->handler;
+
+    dec:
+      *ptr -= ip->arg;
+      ip++;
+      goto *ip->handler;
+
+    out:
+      io->write(io->ctx, *ptr);
+      ip++;
+      goto *ip->handler;
+
+    in:
+      *ptr = io->read(io->ctx);
+      ip++;
+      goto *ip->handler;
+
+    open:
+      ip += *ptr ? 1 : ip->arg;
+      goto *ip->handler;
+
+    close:
+      ip += *ptr ? ip->arg : 1;
+      goto *ip->handler;
+
+    clear:
+      *ptr = 0;
+      ip++;
+      goto *ip->handler;
+
+    halt:
+      break;
+  }
+
+  return BF_OK;
+
+  // replace every opcode with its handler address
+  thread:
+  for (; ; ip++) {
+    uintptr_t op = ip->op;
+    ip->handler = cmds[op];
+    if (op == HALT)
+      break;
+  }
+
+  return BF_OK;
+}
+
+/* Rewrite every opcode of code, up to its HALT, to the address of its handler */
+static void CELL_FN(thread_code)(struct bf_insn *code) {
+  CELL_FN(threaded_body)(code, BF_THREAD, NULL, 0, 0, 0, NULL);
+}
+
+/* Run threaded code from pc, whose opcode before threading was op */
+static int CELL_FN(interp_threaded)(struct bf_insn *code, uintptr_t op, unsigned char *tape,
+                                    size_t tape_size, size_t ptr_off, uint32_t pc,
+                                    const struct bf_io *io) {
+  return CELL_FN(threaded_body)(code, op, tape, tape_size, ptr_off, pc, io);
+}
+
+/*
+ * Interpret one iteration of the loop closed by code[close], from pc, and
+ * record it (see bf_trace.h). Inner loops that already have a trace in
+ * loops[] are run through it and recorded as a call instead of being
+ * unrolled, so their trip count is free to change. Stops before
+ * executing the close and returns true, or returns false wherever it
+ * gave up, with *ptr and *pc left at a consistent point for the
+ * interpreter to continue from.
+ */
+static bool CELL_FN(trace_record)(struct trace *t, const struct bf_insn *code,
+                                  const struct trace_slot *loops, unsigned char *tape,
+                                  size_t tape_size, size_t *ptr, uint32_t *pc, uint32_t close) {
+  CELL *cells = (CELL *)tape;
+  size_t ncells = tape_size / sizeof(CELL);
+  size_t p = *ptr;
+  uint32_t i = *pc;
+  bool done = false;
+
+  t->len = 0;
+
+  while (i != close) {
+    const struct bf_insn *insn = &code[i];
+    struct trace_entry *e;
+
+    if (t->len == TRACE_MAX_INSNS || insn->op == BF_IN || insn->op == BF_OUT)
+      goto out;
+    if (insn->op == BF_RIGHT && p + insn->arg >= ncells)
+      goto out;
+    if (insn->op == BF_LEFT && (intptr_t)p < insn->arg)
+      goto out;
+
+    t->entries = (struct trace_entry *)grow_array(t->entries, &t->cap, t->len + 1,
+                                                  sizeof(struct trace_entry));
+    e = &t->entries[t->len++];
+    e->pc = i;
+    e->op = insn->op;
+    e->arg = insn->arg;
+    e->fn = NULL;
+    e->nonzero = cells[p] != 0;
+
+    if (insn->op == BF_OPEN && loops[i + insn->arg - 1].fn) {
+      uint32_t inner = i + insn->arg - 1;
+
+      e->op = TRACE_CALL;
+      e->arg = inner;
+      e->fn = loops[inner].fn;
+      i = inner + 1;
+      if (cells[p]) {
+        unsigned char *q = (unsigned char *)(cells + p);
+        i = e->fn(&q, tape, (unsigned char *)(cells + ncells));
+        p = (CELL *)q - cells;
+        if (i != inner + 1)
+          goto out;
+      }
+      continue;
+    }
+
+    switch (insn->op) {
+      case BF_RIGHT:
+        p += insn->arg;
+        break;
+      case BF_LEFT:
+        p -= insn->arg;
+        break;
+      case BF_INC:
+        cells[p] += insn->arg;
+        break;
+      case BF_DEC:
+        cells[p] -= insn->arg;
+        break;
+      case BF_CLEAR:
+        cells[p] = 0;
+        break;
+      case BF_OPEN:
+        i += cells[p] ? 1 : insn->arg;
+        continue;
+      case BF_CLOSE:
+        i += cells[p] ? insn->arg : 1;
+        continue;
+    }
+    i++;
+  }
+  done = true;
+
+out:
+  *ptr = p;
+  *pc = i;
+  return done;
+}
+
+static uint32_t CELL_FN(trace_call)(struct trace_run *r, trace_fn fn, size_t *ptr) {
+  unsigned char *p = r->tape + *ptr * sizeof(CELL);
+  uint32_t pc = fn(&p, r->tape, r->tape + r->tape_size);
+
+  *ptr = (p - r->tape) / sizeof(CELL);
+  return pc;
+}
+
+/*
+ * Run the trace of the loop closed at close, at the top of an iteration.
+ * A guard that keeps failing at the same place gets a side trace from
+ * there to the end of the iteration, so data-dependent paths through
+ * the loop end up compiled as well; the traces of the loop are then
+ * linked to it and only come back here for paths not seen yet. Returns
+ * where to go on interpreting.
+ */
+static uint32_t CELL_FN(trace_enter)(struct trace_run *r, uint32_t close, size_t *ptr) {
+  struct trace_slot *loop = &r->loops[close];
+  uint32_t pc = CELL_FN(trace_call)(r, loop->fn, ptr);
+
+  for (;;) {
+    struct trace_slot *side = &r->sides[pc];
+    uint32_t start = pc;
+
+    if (pc == close + 1)
+      return pc;
+
+    // a side trace failing its first guard leaves it to the interpreter
+    if (side->fn && side->anchor == close) {
+      pc = CELL_FN(trace_call)(r, side->fn, ptr);
+      if (pc == start)
+        return pc;
+      continue;
+    }
+
+    if (side->failed || (side->hits && side->anchor != close))
+      return pc;
+    side->anchor = close;
+    if (++side->hits < TRACE_HOT)
+      return pc;
+
+    if (!CELL_FN(trace_record)(&r->rec, r->code, r->loops, r->tape, r->tape_size, ptr, &pc,
+                               close) ||
+        !trace_compile(&r->rec, start, close, false, sizeof(CELL), r->loops, r->sides, side)) {
+      side->failed = true;
+      return pc;
+    }
+
+    trace_link(loop, start, side->fn);
+    for (uint32_t k = 0; k < loop->sides_len; k++)
+      trace_link(&r->sides[loop->sides[k]], start, side->fn);
+    loop->sides = (uint32_t *)grow_array(loop->sides, &loop->sides_cap, loop->sides_len + 1,
+                                         sizeof(uint32_t));
+    loop->sides[loop->sides_len++] = start;
+
+    // the recording stopped at the close, the iteration is not over yet
+    if (!((CELL *)r->tape)[*ptr])
+      return close + 1;
+    pc = CELL_FN(trace_call)(r, loop->fn, ptr);
+  }
+}
+
+/*
+ * Tracing engine: a plain interpreter that counts loop back edges and
+ * hands hot loops to the trace compiler in bf_trace.h. Traces are per
+ * run, which keeps handles immutable and runs independent.
+ */
+static int CELL_FN(interp_trace)(const bf_handle *h, unsigned char *tape, size_t tape_size,
+                                 size_t ptr_off, uint32_t pc, const struct bf_io *io) {
+  const struct bf_insn *code = h->prog.code;
+  CELL *cells = (CELL *)tape;
+  size_t ncells = tape_size / sizeof(CELL);
+  struct trace_run r;
+  size_t ptr = ptr_off;
+  uint32_t i = pc;
+  int rv = BF_OK;
+
+  memset(&r, 0, sizeof(r));
+  r.code = code;
+  r.tape = tape;
+  r.tape_size = ncells * sizeof(CELL);
+  r.loops = (struct trace_slot *)calloc(h->prog.len + 1, sizeof(struct trace_slot));
+  r.sides = (struct trace_slot *)calloc(h->prog.len + 1, sizeof(struct trace_slot));
+
+  for (;;) {
+    const struct bf_insn *insn = &code[i];
+
+    switch (insn->op) {
+      case HALT:
+        goto out;
+      case BF_RIGHT:
+        if (ptr + insn->arg >= ncells) {
+          rv = BF_ERR_TAPE_OVERFLOW;
+          goto out;
+        }
+        ptr += insn->arg;
+        break;
+      case BF_LEFT:
+        if ((intptr_t)ptr < insn->arg) {
+          rv = BF_ERR_TAPE_UNDERFLOW;
+          goto out;
+        }
+        ptr -= insn->arg;
+        break;
+      case BF_INC:
+        cells[ptr] += insn->arg;
+        break;
+      case BF_DEC:
+        cells[ptr] -= insn->arg;
+        break;
+      case BF_OUT:
+        io->write(io->ctx, cells[ptr]);
+        break;
+      case BF_IN:
+        cells[ptr] = io->read(io->ctx);
+        break;
+      case BF_CLEAR:
+        cells[ptr] = 0;
+        break;
+      case BF_OPEN: {
+        uint32_t close = i + insn->arg - 1;
+
+        if (!cells[ptr])
+          i = close + 1;
+        else if (r.loops[close].fn)
+          i = CELL_FN(trace_enter)(&r, close, &ptr);
+        else
+          i++;
+        continue;
+      }
+      case BF_CLOSE: {
+        struct trace_slot *slot = &r.loops[i];
+        uint32_t close = i;
+
+        if (!cells[ptr]) {
+          i++;
+          continue;
+        }
+        if (slot->fn) {
+          i = CELL_FN(trace_enter)(&r, close, &ptr);
+          continue;
+        }
+
+        i += insn->arg;
+        if (slot->failed || ++slot->hits < TRACE_HOT)
+          continue;
+
+        // record this iteration, the close then enters the new trace
+        uint32_t start = i;
+        slot->failed = !CELL_FN(trace_record)(&r.rec, code, r.loops, tape, r.tape_size, &ptr,
+                                              &i, close) ||
+                       !trace_compile(&r.rec, start, close, true, sizeof(CELL), r.loops,
+                                      r.sides, slot);
+        continue;
+      }
+    }
+    i++;
+  }
+
+out:
+  trace_free_slots(r.loops, h->prog.len);
+  trace_free_slots(r.sides, h->prog.len);
+  free(r.rec.entries);
+
+  return rv;
+}
+
+/*
+ * Plain switch interpreter over the opcodes that stops at a given point
+ * (see stop, max_steps, or instruction stop_pc) and leaves *ptr_off and
+ * *pc there. Only used to run up to a snapshot and out of a folded loop
+ * when resuming one, so simplicity wins over dispatch speed.
+ */
+static int CELL_FN(interp_until)(const struct bf_insn *code, unsigned char *tape,
+                                 size_t tape_size, size_t *ptr_off, uint32_t *pc,
+                                 uint64_t *steps, unsigned stop, uint64_t max_steps,
+                                 uint32_t stop_pc, const struct bf_io *io) {
+  CELL *cells = (CELL *)tape;
+  size_t ncells = tape_size / sizeof(CELL);
+  size_t ptr = *ptr_off;
+  uint32_t i = *pc;
+  uint64_t n = 0;
+  int rv = BF_OK;
+
+  for (; code[i].op != HALT; n++) {
+    const struct bf_insn *insn = &code[i];
+
+    if (max_steps && n == max_steps)
+      break;
+    if (i == stop_pc)
+      break;
+    if ((stop & BF_STOP_INPUT) && insn->op == BF_IN)
+      break;
+
+    switch (insn->op) {
+      case BF_RIGHT:
+        if (ptr + insn->arg >= ncells) {
+          rv = BF_ERR_TAPE_OVERFLOW;
+          goto out;
+        }
+        ptr += insn->arg;
+        break;
+      case BF_LEFT:
+        if ((intptr_t)ptr < insn->arg) {
+          rv = BF_ERR_TAPE_UNDERFLOW;
+          goto out;
+        }
+        ptr -= insn->arg;
+        break;
+      case BF_INC:
+        cells[ptr] += insn->arg;
+        break;
+      case BF_DEC:
+        cells[ptr] -= insn->arg;
+        break;
+      case BF_OUT:
+        io->write(io->ctx, cells[ptr]);
+        break;
+      case BF_IN:
+        cells[ptr] = io->read(io->ctx);
+        break;
+      case BF_OPEN:
+        i += cells[ptr] ? 1 : insn->arg;
+        continue;
+      case BF_CLOSE:
+        i += cells[ptr] ? insn->arg : 1;
+        continue;
+      case BF_CLEAR:
+        cells[ptr] = 0;
+        break;
+    }
+    i++;
+  }
+
+out:
+  *ptr_off = ptr;
+  *pc = i;
+  *steps = n;
+  return rv;
+}
+
+#undef CELL
+#undef CELL_FN
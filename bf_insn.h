@@ -0,0 +1,631 @@
+#ifndef BF_INSN_H
+#define BF_INSN_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define HALT 0
+#define BF_RIGHT 1
+#define BF_LEFT 2
+#define BF_INC 3
+#define BF_DEC 4
+#define BF_OUT 5
+#define BF_IN 6
+#define BF_OPEN 7
+#define BF_CLOSE 8
+#define BF_CLEAR 9
+
+/* Parser flags */
+#define BF_PARSE_IDIOMS 1   /* collapse [-] and [+] into BF_CLEAR */
+#define BF_PARSE_POSITIONS 2   /* keep the source position of every instruction */
+
+/* Source is released from the page cache behind the parser every chunk */
+#define BF_PARSE_CHUNK (16UL * 1024 * 1024)
+
+/*
+ * Compact instruction form shared by every engine.
+ *
+ * While parsing `op` holds one of the BF_* commands; the threaded
+ * interpreter rewrites it in place to the address of its handler.
+ *
+ * arg is the repeat count for BF_RIGHT/LEFT/INC/DEC and, for
+ * BF_OPEN/BF_CLOSE, the distance in slots to the instruction that
+ * follows the matching bracket. The matching bracket of an open at i is
+ * at i + arg - 1.
+ */
+struct bf_insn {
+  union {
+    void *handler;
+    uintptr_t op;
+  };
+  intptr_t arg;
+};
+
+/*
+ * Cells are 1, 2 or 4 bytes wide, the engines are specialized per width.
+ * Cell arithmetic wraps, counts in arg are taken modulo the width.
+ */
+static inline uint32_t
+bf_cell_mask(unsigned cell)
+{
+    return cell == 4 ? 0xffffffffu : (1u << (8 * cell)) - 1;
+}
+
+/* Where an instruction starts in the source, line and col count from 1 */
+struct bf_srcpos {
+  uint64_t offset;
+  uint32_t line;
+  uint32_t col;
+};
+
+/*
+ * A parsed program, code[len] is always HALT. Programs loaded from a
+ * bytecode file point into the file mapping (map/map_size), otherwise
+ * code is malloced. pos is only kept when parsing with BF_PARSE_POSITIONS.
+ */
+struct bf_program {
+  struct bf_insn *code;
+  uint32_t len;
+  struct bf_srcpos *pos;
+  void *map;
+  size_t map_size;
+};
+
+/*
+ * Bytecode file: this header followed by len + 1 struct bf_insn in
+ * native byte order, opcodes (not handler addresses) in the op field.
+ * checksum is FNV-1a 64 over the instruction bytes.
+ */
+#define BF_BC_MAGIC "BFBC"
+#define BF_BC_VERSION 1
+
+struct bf_bc_header {
+  char magic[4];
+  uint16_t version;
+  uint16_t insn_size;
+  uint32_t len;
+  uint32_t flags;
+  uint64_t checksum;
+  uint64_t reserved;
+};
+
+struct bf_parser {
+  struct bf_program *prog;
+  uint32_t cap;
+  uint32_t pos_cap;
+  uint32_t *open_stack;
+  uint32_t open_cap;
+  uint32_t open_index;
+  size_t pos;
+  uint32_t line;
+  size_t line_start;
+  int flags;
+};
+
+/* Grow an array of elem_size elements so it holds at least need of them */
+static inline void *
+grow_array(void *array, uint32_t *cap, uint32_t need, size_t elem_size)
+{
+    if (need <= *cap)
+        return array;
+
+    uint32_t new_cap = *cap ? *cap : 64;
+    while (new_cap < need)
+        new_cap *= 2;
+
+    array = realloc(array, (size_t)new_cap * elem_size);
+    if (!array) {
+        fprintf(stderr, "error: out of memory\n");
+        abort();
+    }
+    *cap = new_cap;
+
+    return array;
+}
+
+static inline void
+bf_parser_init(struct bf_parser *p, struct bf_program *prog, int flags)
+{
+    p->prog = prog;
+    p->cap = 0;
+    p->pos_cap = 0;
+    p->open_stack = NULL;
+    p->open_cap = 0;
+    p->open_index = 0;
+    p->pos = 0;
+    p->line = 1;
+    p->line_start = 0;
+    p->flags = flags;
+
+    prog->code = NULL;
+    prog->len = 0;
+    prog->pos = NULL;
+    prog->map = NULL;
+    prog->map_size = 0;
+}
+
+static inline void
+bf_parser_push(struct bf_parser *p, uintptr_t op, intptr_t arg)
+{
+    struct bf_program *prog = p->prog;
+
+    prog->code = (struct bf_insn *)grow_array(prog->code, &p->cap, prog->len + 1,
+                                              sizeof(struct bf_insn));
+    prog->code[prog->len].op = op;
+    prog->code[prog->len].arg = arg;
+
+    if (p->flags & BF_PARSE_POSITIONS) {
+        prog->pos = (struct bf_srcpos *)grow_array(prog->pos, &p->pos_cap, prog->len + 1,
+                                                   sizeof(struct bf_srcpos));
+        prog->pos[prog->len].offset = p->pos;
+        prog->pos[prog->len].line = p->line;
+        prog->pos[prog->len].col = p->pos - p->line_start + 1;
+    }
+
+    prog->len++;
+}
+
+/*
+ * Feed the next len bytes of source to the parser. Runs of > < + - fold
+ * into one instruction and brackets are resolved as they close, so the
+ * source is only ever looked at once.
+ */
+static inline int
+bf_parse_chunk(struct bf_parser *p, const unsigned char *src, size_t len)
+{
+    struct bf_program *prog = p->prog;
+
+    for (size_t i = 0; i < len; i++, p->pos++) {
+        uintptr_t op;
+        uint32_t open;
+
+        switch (src[i]) {
+          case '>': op = BF_RIGHT; goto fold;
+          case '<': op = BF_LEFT; goto fold;
+          case '+': op = BF_INC; goto fold;
+          case '-': op = BF_DEC; goto fold;
+          fold:
+            if (prog->len > 0 && prog->code[prog->len - 1].op == op) {
+                prog->code[prog->len - 1].arg++;
+                break;
+            }
+            bf_parser_push(p, op, 1);
+            break;
+
+          case '.':
+            bf_parser_push(p, BF_OUT, 0);
+            break;
+
+          case ',':
+            bf_parser_push(p, BF_IN, 0);
+            break;
+
+          case '[':
+            p->open_stack = (uint32_t *)grow_array(p->open_stack, &p->open_cap,
+                                                   p->open_index + 1, sizeof(uint32_t));
+            p->open_stack[p->open_index++] = prog->len;
+            bf_parser_push(p, BF_OPEN, 0);
+            break;
+
+          case ']':
+            if (p->open_index == 0) {
+                fprintf(stderr, "error: unmatched ']' at %zu\n", p->pos);
+                return -1;
+            }
+            open = p->open_stack[--p->open_index];
+
+            // [-] and [+] just clear the cell
+            if ((p->flags & BF_PARSE_IDIOMS) && prog->len - open == 2
+                && prog->code[open + 1].arg == 1
+                && (prog->code[open + 1].op == BF_DEC || prog->code[open + 1].op == BF_INC)) {
+                struct bf_srcpos open_pos = { 0 };
+
+                if (prog->pos)
+                    open_pos = prog->pos[open];
+                prog->len = open;
+                bf_parser_push(p, BF_CLEAR, 0);
+                if (prog->pos)
+                    prog->pos[open] = open_pos;
+                break;
+            }
+
+            prog->code[open].arg = prog->len - open + 1;
+            bf_parser_push(p, BF_CLOSE, (intptr_t)open - prog->len + 1);
+            break;
+
+          case '\n':
+            p->line++;
+            p->line_start = p->pos + 1;
+            break;
+
+          default:
+            break;
+        }
+    }
+
+    return 0;
+}
+
+/* Terminate the program with HALT and trim it to size */
+static inline int
+bf_parse_finish(struct bf_parser *p)
+{
+    struct bf_program *prog = p->prog;
+    int rv = 0;
+
+    if (p->open_index != 0) {
+        fprintf(stderr, "error: unmatched '['\n");
+        rv = -1;
+    }
+
+    free(p->open_stack);
+    p->open_stack = NULL;
+
+    if (rv == 0) {
+        uint32_t len = prog->len;
+        bf_parser_push(p, HALT, 0);
+        prog->len = len;
+        prog->code = (struct bf_insn *)realloc(prog->code,
+                                               (len + 1) * sizeof(struct bf_insn));
+    }
+
+    return rv;
+}
+
+/* Drop everything after a parse error */
+static inline void
+bf_parser_abort(struct bf_parser *p)
+{
+    free(p->open_stack);
+    free(p->prog->code);
+    free(p->prog->pos);
+    p->open_stack = NULL;
+    p->prog->code = NULL;
+    p->prog->pos = NULL;
+    p->prog->len = 0;
+}
+
+static inline int
+bf_parse(const unsigned char *src, size_t len, int flags, struct bf_program *prog)
+{
+    struct bf_parser p;
+
+    bf_parser_init(&p, prog, flags);
+    if (bf_parse_chunk(&p, src, len) != 0) {
+        bf_parser_abort(&p);
+        return -1;
+    }
+
+    if (bf_parse_finish(&p) != 0) {
+        free(prog->code);
+        free(prog->pos);
+        prog->code = NULL;
+        prog->pos = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * mmap the source file and parse it in one sequential pass. Pages that
+ * have been parsed are dropped every BF_PARSE_CHUNK bytes so the peak
+ * footprint follows the instruction count rather than the file size.
+ *
+ * Returns 0 on success, -1 if the file can't be read and -2 if it does
+ * not parse.
+ */
+static inline int
+bf_load_source(const char *path, int flags, struct bf_program *prog)
+{
+    struct bf_parser p;
+    struct stat st;
+    int rv = 0;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    bf_parser_init(&p, prog, flags);
+
+    if (st.st_size == 0) {
+        close(fd);
+        return bf_parse_finish(&p) ? -2 : 0;
+    }
+
+    size_t size = st.st_size;
+    unsigned char *src = (unsigned char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (src == MAP_FAILED)
+        return -1;
+
+    madvise(src, size, MADV_SEQUENTIAL);
+
+    for (size_t off = 0; off < size; off += BF_PARSE_CHUNK) {
+        size_t chunk = size - off < BF_PARSE_CHUNK ? size - off : BF_PARSE_CHUNK;
+
+        if (bf_parse_chunk(&p, src + off, chunk) != 0) {
+            rv = -2;
+            break;
+        }
+        madvise(src + off, chunk, MADV_DONTNEED);
+    }
+
+    munmap(src, size);
+
+    if (rv != 0) {
+        bf_parser_abort(&p);
+        return rv;
+    }
+
+    if (bf_parse_finish(&p) != 0) {
+        free(prog->code);
+        free(prog->pos);
+        prog->code = NULL;
+        prog->pos = NULL;
+        return -2;
+    }
+
+    return 0;
+}
+
+/*
+ * Print instructions first..last back as BF source, at most max
+ * characters (0 for no limit) followed by "..." when cut short.
+ */
+static inline void
+bf_print_insns(FILE *f, const struct bf_insn *code, uint32_t first, uint32_t last, size_t max)
+{
+    static const char cmd_chars[] = "\0><+-.,[]";
+    size_t printed = 0;
+
+    for (uint32_t i = first; i <= last; i++) {
+        const char *text = "[-]";
+        intptr_t n = 1;
+
+        if (code[i].op != BF_CLEAR) {
+            text = &cmd_chars[code[i].op];
+            if (code[i].op >= BF_RIGHT && code[i].op <= BF_DEC)
+                n = code[i].arg;
+        }
+
+        for (intptr_t j = 0; j < n; j++) {
+            size_t text_len = code[i].op == BF_CLEAR ? 3 : 1;
+
+            if (max && printed + text_len > max) {
+                fputs("...", f);
+                return;
+            }
+            fwrite(text, text_len, 1, f);
+            printed += text_len;
+        }
+    }
+}
+
+static const char *const bf_op_names[] = {
+    "halt", "right", "left", "inc", "dec", "out", "in", "open", "close", "clear"
+};
+
+/*
+ * Print code[i] on a line of its own for the IR dumps, indented by
+ * depth: index, opcode and operand, or for a bracket the index of the
+ * matching one.
+ */
+static inline void
+bf_dump_insn(FILE *f, const struct bf_insn *code, uint32_t i, int depth)
+{
+    fprintf(f, "%10u  %*s%s", i, 2 * depth, "", bf_op_names[code[i].op]);
+
+    switch (code[i].op) {
+      case BF_RIGHT: case BF_LEFT: case BF_INC: case BF_DEC:
+        fprintf(f, " %ld\n", (long)code[i].arg);
+        break;
+      case BF_OPEN: case BF_CLOSE:
+        fprintf(f, " -> %ld\n", (long)i + code[i].arg - 1);
+        break;
+      default:
+        fputc('\n', f);
+        break;
+    }
+}
+
+/* The whole instruction stream, one instruction per line */
+static inline void
+bf_dump_program(FILE *f, const struct bf_program *prog)
+{
+    int depth = 0;
+
+    for (uint32_t i = 0; i < prog->len; i++) {
+        if (prog->code[i].op == BF_CLOSE)
+            depth--;
+        bf_dump_insn(f, prog->code, i, depth);
+        if (prog->code[i].op == BF_OPEN)
+            depth++;
+    }
+}
+
+static inline void
+bf_program_free(struct bf_program *prog)
+{
+    if (prog->map)
+        munmap(prog->map, prog->map_size);
+    else
+        free(prog->code);
+    free(prog->pos);
+
+    prog->code = NULL;
+    prog->pos = NULL;
+    prog->len = 0;
+    prog->map = NULL;
+    prog->map_size = 0;
+}
+
+static inline uint64_t
+bf_checksum(const void *data, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (size_t i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+static inline int
+bf_write_bytecode(FILE *ofile, const struct bf_program *prog, uint32_t flags)
+{
+    struct bf_bc_header hdr;
+    size_t code_size = (prog->len + 1) * sizeof(struct bf_insn);
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, BF_BC_MAGIC, 4);
+    hdr.version = BF_BC_VERSION;
+    hdr.insn_size = sizeof(struct bf_insn);
+    hdr.len = prog->len;
+    hdr.flags = flags;
+    hdr.checksum = bf_checksum(prog->code, code_size);
+
+    if (fwrite(&hdr, sizeof(hdr), 1, ofile) != 1
+        || fwrite(prog->code, code_size, 1, ofile) != 1)
+        return -1;
+
+    return 0;
+}
+
+/*
+ * Check that a mapped instruction stream is one we can run blindly: known
+ * opcodes, brackets that point at each other and nest, and a final HALT.
+ * The loop analyses all take nesting for granted, so a close must match
+ * the innermost open loop, not just any open pointing back at it.
+ */
+static inline int
+bf_validate(struct bf_insn *code, uint32_t len)
+{
+    uint32_t *open_stack = NULL;
+    uint32_t open_cap = 0;
+    uint32_t depth = 0;
+    int rv = -1;
+
+    for (uint32_t i = 0; i < len; i++) {
+        intptr_t target;
+
+        switch (code[i].op) {
+          case BF_OPEN:
+            target = (intptr_t)i + code[i].arg - 1;
+            if (target <= (intptr_t)i || target >= (intptr_t)len
+                || code[target].op != BF_CLOSE
+                || (intptr_t)target + code[target].arg - 1 != (intptr_t)i)
+                goto out;
+            open_stack = (uint32_t *)grow_array(open_stack, &open_cap, depth + 1,
+                                                sizeof(uint32_t));
+            open_stack[depth++] = i;
+            break;
+
+          case BF_CLOSE:
+            target = (intptr_t)i + code[i].arg - 1;
+            if (target < 0 || target >= (intptr_t)i || code[target].op != BF_OPEN
+                || depth == 0 || open_stack[depth - 1] != (uint32_t)target)
+                goto out;
+            depth--;
+            break;
+
+          case BF_RIGHT:
+          case BF_LEFT:
+            if (code[i].arg <= 0)
+                return -1;
+            break;
+
+          case BF_INC:
+          case BF_DEC:
+          case BF_OUT:
+          case BF_IN:
+          case BF_CLEAR:
+            break;
+
+          default:
+            goto out;
+        }
+    }
+
+    if (depth == 0 && code[len].op == HALT)
+        rv = 0;
+out:
+    free(open_stack);
+    return rv;
+}
+
+/*
+ * mmap a bytecode file written by bf_write_bytecode. The mapping is
+ * private and writable so engines can thread the code in place; pages are
+ * only copied if they do.
+ *
+ * Returns 0 on success, -1 if the file can't be read, -2 if it is not a
+ * bytecode file and -3 if it is corrupt or from another version.
+ */
+static inline int
+bf_load_bytecode(const char *path, struct bf_program *prog)
+{
+    struct bf_bc_header *hdr;
+    struct stat st;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    if ((size_t)st.st_size < sizeof(struct bf_bc_header)) {
+        close(fd);
+        return -2;
+    }
+
+    size_t size = st.st_size;
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+
+    hdr = (struct bf_bc_header *)map;
+    if (memcmp(hdr->magic, BF_BC_MAGIC, 4) != 0) {
+        munmap(map, size);
+        return -2;
+    }
+
+    size_t code_size = ((size_t)hdr->len + 1) * sizeof(struct bf_insn);
+    struct bf_insn *code = (struct bf_insn *)(hdr + 1);
+
+    if (hdr->version != BF_BC_VERSION || hdr->insn_size != sizeof(struct bf_insn)
+        || size != sizeof(*hdr) + code_size
+        || bf_checksum(code, code_size) != hdr->checksum
+        || bf_validate(code, hdr->len) != 0) {
+        munmap(map, size);
+        return -3;
+    }
+
+    prog->code = code;
+    prog->len = hdr->len;
+    prog->pos = NULL;
+    prog->map = map;
+    prog->map_size = size;
+
+    return 0;
+}
+
+#endif
@@ -1,12 +1,14 @@
 #ifndef BF_JIT_X86_64_H
 #define BF_JIT_X86_64_H
 
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <inttypes.h>
+#include "bf_insn.h"
 
-#define MAX_OFFSET 1048576
-#define MAX_NESTING 100
+#define JIT_INITIAL_SIZE 65536
 
 #define RAX 0
 #define RCX 1
@@ -29,11 +31,16 @@
 struct jit_state {
   uint8_t *buf;
   uint32_t offset;
+  uint32_t size;
+  uint32_t cell;     /* BF cell width in bytes, for the emit_cell_* helpers */
 };
 
 static inline void
 emit_bytes(struct jit_state *state, void *data, uint32_t len)
 {
+    if (state->offset + len > state->size)
+        state->buf = (uint8_t *)grow_array(state->buf, &state->size,
+                                           state->offset + len, 1);
     memcpy(state->buf + state->offset, data, len);
     state->offset += len;
 }
@@ -88,6 +95,101 @@ emit_pop(struct jit_state *state, int r)
     emit1(state, 0x58 | (r & 7));
 }
 
+/*
+ * BF cells, 1, 2 or 4 bytes wide as set in state->cell. The helpers
+ * take a memory operand [base+disp], base neither rsp nor rbp, and pick
+ * the byte, word (0x66 prefix) or dword form of the instruction.
+ */
+
+/* mod r/m for [base+disp] with the shortest displacement that fits */
+static inline void
+emit_cell_mem(struct jit_state *state, int reg, int base, intptr_t disp)
+{
+    if (disp == 0) {
+        emit1(state, (reg << 3) | base);
+    }
+    else if (disp >= -128 && disp <= 127) {
+        emit1(state, 0x40 | (reg << 3) | base);
+        emit1(state, disp & 0xff);
+    }
+    else {
+        emit1(state, 0x80 | (reg << 3) | base);
+        emit4(state, (uint32_t)disp);
+    }
+}
+
+/* Opcode of the cell form of a byte instruction, which is opcode + 1 */
+static inline void
+emit_cell_opcode(struct jit_state *state, uint8_t opcode)
+{
+    if (state->cell == 2)
+        emit1(state, 0x66);
+    emit1(state, state->cell == 1 ? opcode : opcode + 1);
+}
+
+static inline void
+emit_cell_imm(struct jit_state *state, uint32_t imm)
+{
+    if (state->cell == 1)
+        emit1(state, imm);
+    else if (state->cell == 2)
+        emit2(state, imm);
+    else
+        emit4(state, imm);
+}
+
+/* add/sub/cmp (reg 0/5/7) cell [base+disp], imm, sign-extended imm8 if it fits */
+static inline void
+emit_cell_alu(struct jit_state *state, int reg, int base, intptr_t disp, uint32_t imm)
+{
+    int32_t simm = state->cell == 2 ? (int16_t)imm : (int32_t)imm;
+
+    if (state->cell != 1 && simm >= -128 && simm <= 127) {
+        if (state->cell == 2)
+            emit1(state, 0x66);
+        emit1(state, 0x83);
+        emit_cell_mem(state, reg, base, disp);
+        emit1(state, imm);
+        return;
+    }
+    emit_cell_opcode(state, 0x80);
+    emit_cell_mem(state, reg, base, disp);
+    emit_cell_imm(state, imm);
+}
+
+/* mov cell [base+disp], imm */
+static inline void
+emit_cell_mov(struct jit_state *state, int base, intptr_t disp, uint32_t imm)
+{
+    emit_cell_opcode(state, 0xc6);
+    emit_cell_mem(state, 0, base, disp);
+    emit_cell_imm(state, imm);
+}
+
+/* test cell [base+disp], imm */
+static inline void
+emit_cell_test(struct jit_state *state, int base, intptr_t disp, uint32_t imm)
+{
+    emit_cell_opcode(state, 0xf6);
+    emit_cell_mem(state, 0, base, disp);
+    emit_cell_imm(state, imm);
+}
+
+/* inc/dec (reg 0/1) cell [base+disp] */
+static inline void
+emit_cell_incdec(struct jit_state *state, int reg, int base, intptr_t disp)
+{
+    emit_cell_opcode(state, 0xfe);
+    emit_cell_mem(state, reg, base, disp);
+}
+
+/* Size of cmp cell [reg], 0 */
+static inline uint32_t
+cell_test_size(uint32_t cell)
+{
+    return cell == 2 ? 4 : 3;
+}
+
 static inline void emit(unsigned char *buf, unsigned char byte) {
   *buf = byte;
   buf++;
@@ -3,33 +3,109 @@
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/raw_ostream.h"
+#include <atomic>
+#include <cstdio>
 #include <stack>
 #include <string>
+#include <thread>
+#include <vector>
 #include <iostream>
 #include <fstream>
+#include <cstring>
+#include "bf_phases.h"
 
 #define TAP_SIZE 1048576
 
+// Regions of at least this many bytes of source, about REGIONS_PER_JOB per thread
+#define REGION_MIN 16384
+#define REGIONS_PER_JOB 4
+
 using namespace llvm;
 
-void compile(std::string code) {
+// --time-phases: the phases are timed and reported as in bfc
+static bool time_phases = false;
+static struct bf_phases phases;
+
+// --dump-ir=<stage>: regions, link or all
+static std::string dump_ir;
+
+static void phase(const char *name) {
+    if (time_phases)
+        bf_phase_end(&phases, name);
+}
+
+static bool dump_stage(const char *stage) {
+    return dump_ir == stage || dump_ir == "all";
+}
+
+static size_t count_insns(const Module &M) {
+    size_t n = 0;
+
+    for (const Function &F : M)
+        n += F.getInstructionCount();
+    return n;
+}
+
+/*
+ * Big programs are compiled in parallel: the source is cut into regions at
+ * top-level bracket-balanced boundaries, so every loop is whole inside one
+ * region, and each region becomes a function of its own,
+ *
+ *   i64 @bf_region_<k>(i64 %index)
+ *
+ * which takes the tape index on entry and returns it on exit. The regions
+ * are generated on a pool of threads, each in its own LLVMContext, handed
+ * over as bitcode and linked into the module, whose main calls them in
+ * order.
+ */
+
+std::vector<size_t> split_regions(const std::string &code, unsigned jobs) {
+    size_t target = std::max<size_t>(code.size() / (jobs * REGIONS_PER_JOB), REGION_MIN);
+    std::vector<size_t> bounds = {0};
+    int depth = 0;
+
+    for (size_t i = 0; i < code.size(); i++) {
+        if (code[i] == '[')
+            depth++;
+        else if (code[i] == ']')
+            depth--;
+
+        if (depth == 0 && i + 1 - bounds.back() >= target && i + 1 < code.size())
+            bounds.push_back(i + 1);
+    }
+    bounds.push_back(code.size());
+
+    return bounds;
+}
+
+ArrayType *memory_type(LLVMContext &Context, unsigned cell_bits) {
+    // TAP_SIZE bytes of cell_bits wide cells
+    return ArrayType::get(IntegerType::get(Context, cell_bits), TAP_SIZE / (cell_bits / 8));
+}
+
+// Generate code[start..end) as @bf_region_<k> and return it as bitcode
+void compile_region(const std::string &code, size_t start, size_t end, unsigned k,
+                    unsigned cell_bits, SmallVector<char, 0> &bitcode) {
     LLVMContext Context;
-    Module *module = new Module("brainfused", Context);
+    Module *module = new Module("bf_region", Context);
     IRBuilder<> Builder(Context);
 
-    // Create tap
-    ArrayType *MemoryType = ArrayType::get(Type::getInt8Ty(Context), TAP_SIZE);
+    // the tape is defined in the main module
+    Type *CellType = Builder.getIntNTy(cell_bits);
+    ArrayType *MemoryType = memory_type(Context, cell_bits);
     GlobalVariable *Memory = new GlobalVariable(*module, MemoryType, false,
-                                                GlobalValue::PrivateLinkage,
-                                                Constant::getNullValue(MemoryType),
-                                                "memory");
-    Value *TapePtr = Builder.CreateGEP(MemoryType, Memory, {Builder.getInt32(0), Builder.getInt32(0)}, "tape_ptr");
+                                                GlobalValue::ExternalLinkage,
+                                                nullptr, "memory");
 
-    // Create main function
-    FunctionType *FuncType = FunctionType::get(Type::getInt32Ty(Context), false);
-    Function *MainFunc = Function::Create(FuncType, Function::ExternalLinkage, "main", module);
-    BasicBlock *EntryBB = BasicBlock::Create(Context, "entry", MainFunc);
+    FunctionType *FuncType = FunctionType::get(Type::getInt64Ty(Context), {Type::getInt64Ty(Context)}, false);
+    Function *RegionFunc = Function::Create(FuncType, Function::ExternalLinkage,
+                                            "bf_region_" + std::to_string(k), module);
+    BasicBlock *EntryBB = BasicBlock::Create(Context, "entry", RegionFunc);
     Builder.SetInsertPoint(EntryBB);
 
     // putchar function
@@ -37,12 +113,14 @@ void compile(std::string code) {
     FunctionCallee PutcharFunc = module->getOrInsertFunction("putchar", PutcharType);
 
     AllocaInst *TapIndex = Builder.CreateAlloca(Type::getInt64Ty(Context), nullptr, "tap_index");
-    Builder.CreateStore(Builder.getInt64(0), TapIndex);
+    Builder.CreateStore(RegionFunc->getArg(0), TapIndex);
 
     std::stack<BasicBlock *> loopStartStack;
     std::stack<BasicBlock *> loopEndStack;
 
-    for (char cmd : code) {
+    for (size_t i = start; i < end; i++) {
+        char cmd = code[i];
+
         switch (cmd) {
             case '>': {
                 Value *CurrIndex = Builder.CreateLoad(Type::getInt64Ty(Context), TapIndex, "load_index");
@@ -60,27 +138,27 @@ void compile(std::string code) {
 
             case '+': {
                 Value *CurrIndex = Builder.CreateLoad(Type::getInt64Ty(Context), TapIndex, "load_index");
-                Value *Ptr = Builder.CreateGEP(MemoryType, TapePtr, {Builder.getInt64(0), CurrIndex}, "get_ptr");
-                Value *Val = Builder.CreateLoad(Type::getInt8Ty(Context), Ptr, "load_val");
-                Val = Builder.CreateAdd(Val, Builder.getInt8(1), "inc_val");
+                Value *Ptr = Builder.CreateGEP(MemoryType, Memory, {Builder.getInt64(0), CurrIndex}, "get_ptr");
+                Value *Val = Builder.CreateLoad(CellType, Ptr, "load_val");
+                Val = Builder.CreateAdd(Val, ConstantInt::get(CellType, 1), "inc_val");
                 Builder.CreateStore(Val, Ptr);
                 break;
             }
 
             case '-': {
                 Value *CurrIndex = Builder.CreateLoad(Type::getInt64Ty(Context), TapIndex, "load_index");
-                Value *Ptr = Builder.CreateGEP(MemoryType, TapePtr, {Builder.getInt64(0), CurrIndex}, "get_ptr");
-                Value *Val = Builder.CreateLoad(Type::getInt8Ty(Context), Ptr, "load_val");
-                Val = Builder.CreateSub(Val, Builder.getInt8(1), "dec_val");
+                Value *Ptr = Builder.CreateGEP(MemoryType, Memory, {Builder.getInt64(0), CurrIndex}, "get_ptr");
+                Value *Val = Builder.CreateLoad(CellType, Ptr, "load_val");
+                Val = Builder.CreateSub(Val, ConstantInt::get(CellType, 1), "dec_val");
                 Builder.CreateStore(Val, Ptr);
                 break;
             }
 
             case '.': {
                 Value *CurrIndex = Builder.CreateLoad(Type::getInt64Ty(Context), TapIndex, "load_index");
-                Value *Ptr = Builder.CreateGEP(MemoryType, TapePtr, {Builder.getInt64(0), CurrIndex}, "get_ptr");
-                Value *Val = Builder.CreateLoad(Type::getInt8Ty(Context), Ptr, "load_val");
-                Value *Int32Byte = Builder.CreateSExt(Val, Type::getInt32Ty(Context), "int32byte");
+                Value *Ptr = Builder.CreateGEP(MemoryType, Memory, {Builder.getInt64(0), CurrIndex}, "get_ptr");
+                Value *Val = Builder.CreateLoad(CellType, Ptr, "load_val");
+                Value *Int32Byte = Builder.CreateSExtOrTrunc(Val, Type::getInt32Ty(Context), "int32byte");
                 Builder.CreateCall(PutcharFunc, Int32Byte);
                 break;
             }
@@ -89,13 +167,13 @@ void compile(std::string code) {
                 break;
 
             case '[': {
-                BasicBlock *LoopStartBB = BasicBlock::Create(Context, "loop_start", MainFunc);
-                BasicBlock *LoopEndBB = BasicBlock::Create(Context, "loop_end", MainFunc);
+                BasicBlock *LoopStartBB = BasicBlock::Create(Context, "loop_start", RegionFunc);
+                BasicBlock *LoopEndBB = BasicBlock::Create(Context, "loop_end", RegionFunc);
 
                 Value *CurrIndex = Builder.CreateLoad(Type::getInt64Ty(Context), TapIndex, "load_index");
-                Value *Ptr = Builder.CreateGEP(MemoryType, TapePtr, {Builder.getInt64(0), CurrIndex}, "get_ptr");
-                Value *Val = Builder.CreateLoad(Type::getInt8Ty(Context), Ptr, "load_val");
-                Value *Cond = Builder.CreateICmpEQ(Val, Builder.getInt8(0), "loopcond");
+                Value *Ptr = Builder.CreateGEP(MemoryType, Memory, {Builder.getInt64(0), CurrIndex}, "get_ptr");
+                Value *Val = Builder.CreateLoad(CellType, Ptr, "load_val");
+                Value *Cond = Builder.CreateICmpEQ(Val, ConstantInt::get(CellType, 0), "loopcond");
                 Builder.CreateCondBr(Cond, LoopEndBB, LoopStartBB);
 
                 Builder.SetInsertPoint(LoopStartBB);
@@ -112,9 +190,9 @@ void compile(std::string code) {
                 loopEndStack.pop();
 
                 Value *CurrIndex = Builder.CreateLoad(Type::getInt64Ty(Context), TapIndex, "load_index");
-                Value *Ptr = Builder.CreateGEP(MemoryType, TapePtr, {Builder.getInt64(0), CurrIndex}, "get_ptr");
-                Value *Val = Builder.CreateLoad(Type::getInt8Ty(Context), Ptr, "load_val");
-                Value *Cond = Builder.CreateICmpEQ(Val, Builder.getInt8(0), "loopcond");
+                Value *Ptr = Builder.CreateGEP(MemoryType, Memory, {Builder.getInt64(0), CurrIndex}, "get_ptr");
+                Value *Val = Builder.CreateLoad(CellType, Ptr, "load_val");
+                Value *Cond = Builder.CreateICmpEQ(Val, ConstantInt::get(CellType, 0), "loopcond");
                 Builder.CreateCondBr(Cond, LoopEndBB, LoopStartBB);
                 Builder.SetInsertPoint(LoopEndBB);
                 break;
@@ -122,25 +200,171 @@ void compile(std::string code) {
         }
     }
 
+    Builder.CreateRet(Builder.CreateLoad(Type::getInt64Ty(Context), TapIndex, "load_index"));
+
+    raw_svector_ostream OS(bitcode);
+    WriteBitcodeToFile(*module, OS);
+    delete module;
+}
+
+void compile(std::string code, unsigned cell_bits, unsigned jobs) {
+    std::vector<size_t> bounds = split_regions(code, jobs);
+    size_t nregions = bounds.size() - 1;
+    phase("split");
+
+    std::vector<SmallVector<char, 0>> bitcode(nregions);
+    std::vector<std::thread> threads;
+    std::atomic<size_t> next(0);
+
+    auto worker = [&]() {
+        size_t k;
+        while ((k = next++) < nregions)
+            compile_region(code, bounds[k], bounds[k + 1], k, cell_bits, bitcode[k]);
+    };
+    for (unsigned t = 1; t < std::min<size_t>(jobs, nregions); t++)
+        threads.emplace_back(worker);
+    worker();
+    for (std::thread &t : threads)
+        t.join();
+    phase("codegen");
+
+    LLVMContext Context;
+    Module *module = new Module("brainfused", Context);
+    IRBuilder<> Builder(Context);
+
+    // Create tap, made private once the regions are linked against it
+    ArrayType *MemoryType = memory_type(Context, cell_bits);
+    GlobalVariable *Memory = new GlobalVariable(*module, MemoryType, false,
+                                                GlobalValue::ExternalLinkage,
+                                                Constant::getNullValue(MemoryType),
+                                                "memory");
+
+    std::vector<std::unique_ptr<Module>> regions;
+    size_t region_insns = 0;
+    for (size_t k = 0; k < nregions; k++) {
+        StringRef Buf(bitcode[k].data(), bitcode[k].size());
+        Expected<std::unique_ptr<Module>> Region = parseBitcodeFile(MemoryBufferRef(Buf, "bf_region"), Context);
+        if (!Region) {
+            consumeError(Region.takeError());
+            std::cerr << "Error: could not read region " << k << std::endl;
+            exit(1);
+        }
+        region_insns += count_insns(**Region);
+        regions.push_back(std::move(*Region));
+    }
+
+    if (!dump_ir.empty()) {
+        size_t commands = 0;
+        for (char cmd : code) {
+            if (cmd && strchr("><+-.,[]", cmd))
+                commands++;
+        }
+
+        fprintf(stderr, ";; regions: %zu commands -> %zu instructions in %zu functions\n",
+                commands, region_insns, nregions);
+        if (dump_stage("regions")) {
+            for (std::unique_ptr<Module> &Region : regions)
+                Region->print(errs(), nullptr);
+        }
+        phase("dump-ir");
+    }
+
+    // Stitch the regions in
+    Linker L(*module);
+    for (size_t k = 0; k < nregions; k++) {
+        if (L.linkInModule(std::move(regions[k]))) {
+            std::cerr << "Error: could not link region " << k << std::endl;
+            exit(1);
+        }
+    }
+    Memory->setLinkage(GlobalValue::PrivateLinkage);
+
+    // Create main function, calling every region in order
+    FunctionType *FuncType = FunctionType::get(Type::getInt32Ty(Context), false);
+    Function *MainFunc = Function::Create(FuncType, Function::ExternalLinkage, "main", module);
+    BasicBlock *EntryBB = BasicBlock::Create(Context, "entry", MainFunc);
+    Builder.SetInsertPoint(EntryBB);
+
+    Value *Index = Builder.getInt64(0);
+    for (size_t k = 0; k < nregions; k++) {
+        Function *RegionFunc = module->getFunction("bf_region_" + std::to_string(k));
+        RegionFunc->setLinkage(GlobalValue::InternalLinkage);
+        Index = Builder.CreateCall(RegionFunc, Index, "index");
+    }
+
     Builder.CreateRet(Builder.getInt32(0));
+    phase("link");
+
+    if (!dump_ir.empty()) {
+        fprintf(stderr, ";; link: %zu -> %zu instructions\n", region_insns, count_insns(*module));
+        if (dump_stage("link"))
+            module->print(errs(), nullptr);
+        phase("dump-ir");
+    }
 
     auto res = llvm::verifyModule(*module, &llvm::errs());
     assert(!res);
+    phase("verify");
 
     // Output the LLVM IR
     module->print(outs(), nullptr);
+    outs().flush();
+    phase("print");
     delete module;
 }
 
 int main(int argc, char *argv[]) {
-    if (argc < 2) {
-        std::cerr << "Usage: " << argv[0] << " <brainfuck code>" << std::endl;
+    unsigned cell_bits = 8;
+    unsigned jobs = std::max(std::thread::hardware_concurrency(), 1u);
+    int arg = 1;
+
+    for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++) {
+        if (strncmp(argv[arg], "--cell=", 7) == 0) {
+            cell_bits = strtoul(argv[arg] + 7, nullptr, 10);
+            if (cell_bits != 8 && cell_bits != 16 && cell_bits != 32) {
+                std::cerr << "Error: --cell takes 8, 16 or 32 (bits)" << std::endl;
+                return 1;
+            }
+        }
+        else if (strcmp(argv[arg], "--time-phases") == 0) {
+            time_phases = true;
+        }
+        else if (strncmp(argv[arg], "--dump-ir=", 10) == 0) {
+            dump_ir = argv[arg] + 10;
+            if (dump_ir != "regions" && dump_ir != "link" && dump_ir != "all") {
+                std::cerr << "Error: --dump-ir takes regions, link or all" << std::endl;
+                return 1;
+            }
+        }
+        else if (strncmp(argv[arg], "--jobs=", 7) == 0) {
+            jobs = strtoul(argv[arg] + 7, nullptr, 10);
+            if (jobs < 1) {
+                std::cerr << "Error: --jobs takes a number of threads" << std::endl;
+                return 1;
+            }
+        }
+        else {
+            std::cerr << "Error: unknown option " << argv[arg] << std::endl;
+            return 1;
+        }
+    }
+
+    if (arg >= argc) {
+        std::cerr << "Usage: " << argv[0] << " [--cell=8|16|32] [--jobs=N] [--time-phases]"
+                  << " [--dump-ir=regions|link|all] <brainfuck code>" << std::endl;
         return 1;
     }
 
-    std::ifstream infile(argv[1]);
+    if (time_phases)
+        bf_phases_start(&phases);
+
+    std::ifstream infile(argv[arg]);
     std::string code((std::istreambuf_iterator<char>(infile)), std::istreambuf_iterator<char>());
-    compile(code);
+    phase("read");
+    compile(code, cell_bits, jobs);
+
+    if (time_phases)
+        bf_phases_report(stderr, &phases);
 
     return 0;
 }
@@ -0,0 +1,317 @@
+#ifndef BF_LOOPS_H
+#define BF_LOOPS_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include "bf_insn.h"
+
+/*
+ * Loop analysis shared by the native backends.
+ *
+ * A counted loop has a body of only pointer moves, adds and clears, comes
+ * back to the cell it started on and steps that cell by exactly +1 or -1
+ * per iteration, modulo the cell width. It runs as many iterations as
+ * the counter says on entry and reads no other cell, so any number of
+ * its iterations fold into one straight-line block: every cell it
+ * touches is either set to a constant or moved by a constant times the
+ * iteration count.
+ *
+ * Since the tape starts out zeroed, straight-line code at the start of a
+ * program (and after any clear) often leaves the counter of such a loop
+ * with a value known at compile time. bf_known_trips finds those loops,
+ * which then need no loop code at all.
+ */
+
+#define BF_COUNTED_MAX_BODY 64
+#define BF_COUNTED_MAX_OFFSET (1 << 28)
+#define BF_KNOWN_CELLS 256
+
+/* No trip count known for the loop at this '[' */
+#define BF_TRIP_UNKNOWN -1
+
+/*
+ * What one iteration of a counted loop does to the cell at off relative
+ * to the counter: set it to value, or add value to it.
+ */
+struct bf_cell_effect {
+  intptr_t off;
+  bool set;
+  uint32_t value;
+};
+
+/*
+ * Fill cells (BF_COUNTED_MAX_BODY of them) with the effect of one
+ * iteration of the loop opened at code[open], on cells of cell bytes, and
+ * return how many there are, or 0 if the loop is not counted.
+ */
+static inline uint32_t
+bf_counted_loop(const struct bf_insn *code, uint32_t open, unsigned cell,
+                struct bf_cell_effect *cells)
+{
+    uint32_t mask = bf_cell_mask(cell);
+    uint32_t close = open + code[open].arg - 1;
+    uint32_t n = 0;
+    intptr_t off = 0;
+
+    if (close - open - 1 > BF_COUNTED_MAX_BODY)
+        return 0;
+
+    for (uint32_t i = open + 1; i < close; i++) {
+        const struct bf_insn *insn = &code[i];
+        uint32_t c;
+
+        switch (insn->op) {
+            case BF_RIGHT:
+                off += insn->arg;
+                continue;
+            case BF_LEFT:
+                off -= insn->arg;
+                continue;
+            case BF_INC:
+            case BF_DEC:
+            case BF_CLEAR:
+                break;
+            default:
+                return 0;
+        }
+
+        if (off > BF_COUNTED_MAX_OFFSET || off < -BF_COUNTED_MAX_OFFSET)
+            return 0;
+
+        for (c = 0; c < n && cells[c].off != off; c++)
+            ;
+        if (c == n) {
+            cells[n].off = off;
+            cells[n].set = false;
+            cells[n].value = 0;
+            n++;
+        }
+
+        if (insn->op == BF_CLEAR) {
+            cells[c].set = true;
+            cells[c].value = 0;
+        }
+        else {
+            cells[c].value += insn->op == BF_INC ? insn->arg : -insn->arg;
+            cells[c].value &= mask;
+        }
+    }
+
+    if (off != 0)
+        return 0;
+
+    for (uint32_t c = 0; c < n; c++) {
+        if (cells[c].off == 0)
+            return !cells[c].set && (cells[c].value == 1 || cells[c].value == mask) ? n : 0;
+    }
+
+    return 0;
+}
+
+/* Iterations a counted loop runs with its counter at value */
+static inline uint32_t
+bf_counted_trips(const struct bf_cell_effect *cells, uint32_t n, unsigned cell, uint32_t value)
+{
+    uint32_t mask = bf_cell_mask(cell);
+
+    for (uint32_t c = 0; c < n; c++) {
+        if (cells[c].off == 0)
+            return cells[c].value == mask ? value : -value & mask;
+    }
+    return 0;
+}
+
+/* Cell values known at one point of the program, relative to the pointer */
+struct bf_known {
+  intptr_t off[BF_KNOWN_CELLS];
+  uint32_t value[BF_KNOWN_CELLS];
+  uint32_t len;
+  bool rest_zero;    /* cells not listed are known to be 0 */
+};
+
+static inline int64_t
+bf_known_get(const struct bf_known *k, intptr_t off)
+{
+    for (uint32_t i = 0; i < k->len; i++) {
+        if (k->off[i] == off)
+            return k->value[i];
+    }
+    return k->rest_zero ? 0 : -1;
+}
+
+static inline void
+bf_known_set(struct bf_known *k, intptr_t off, int64_t value)
+{
+    uint32_t i;
+
+    for (i = 0; i < k->len && k->off[i] != off; i++)
+        ;
+
+    if (value < 0) {
+        // forgetting a cell also forgets that the unlisted ones are 0
+        if (i < k->len) {
+            k->len--;
+            k->off[i] = k->off[k->len];
+            k->value[i] = k->value[k->len];
+        }
+        if (k->rest_zero)
+            k->len = 0;
+        k->rest_zero = false;
+        return;
+    }
+
+    if (i == k->len) {
+        if (k->len == BF_KNOWN_CELLS) {
+            k->len = 0;
+            k->rest_zero = false;
+            i = 0;
+        }
+        k->off[i] = off;
+        k->len++;
+    }
+    k->value[i] = value;
+}
+
+/*
+ * Forward pass over the program tracking which cells hold known values:
+ * all of them at the start, none at the top of a loop that is not folded
+ * and only the tested one, as 0, after it. trips[open] is set to the trip
+ * count of every counted loop whose counter is known on entry and to
+ * BF_TRIP_UNKNOWN for every other '['.
+ */
+static inline void
+bf_known_trips(const struct bf_program *prog, unsigned cell, int64_t *trips)
+{
+    struct bf_known *k = (struct bf_known *)malloc(sizeof(struct bf_known));
+    struct bf_cell_effect cells[BF_COUNTED_MAX_BODY];
+    uint32_t mask = bf_cell_mask(cell);
+    intptr_t cur = 0;
+
+    k->len = 0;
+    k->rest_zero = true;
+
+    for (uint32_t i = 0; i < prog->len; i++) {
+        const struct bf_insn *insn = &prog->code[i];
+        int64_t v;
+
+        switch (insn->op) {
+            case BF_RIGHT:
+                cur += insn->arg;
+                break;
+            case BF_LEFT:
+                cur -= insn->arg;
+                break;
+            case BF_INC:
+            case BF_DEC:
+                v = bf_known_get(k, cur);
+                if (v >= 0)
+                    bf_known_set(k, cur, (v + (insn->op == BF_INC ? insn->arg : -insn->arg)) & mask);
+                break;
+            case BF_CLEAR:
+                bf_known_set(k, cur, 0);
+                break;
+            case BF_IN:
+                bf_known_set(k, cur, -1);
+                break;
+            case BF_OPEN: {
+                uint32_t n = bf_counted_loop(prog->code, i, cell, cells);
+
+                v = bf_known_get(k, cur);
+                trips[i] = BF_TRIP_UNKNOWN;
+                if (!n || v < 0) {
+                    k->len = 0;
+                    k->rest_zero = false;
+                    cur = 0;
+                    break;
+                }
+
+                uint32_t t = bf_counted_trips(cells, n, cell, v);
+                trips[i] = t;
+                for (uint32_t c = 0; t && c < n; c++) {
+                    int64_t w = bf_known_get(k, cur + cells[c].off);
+
+                    if (cells[c].set)
+                        bf_known_set(k, cur + cells[c].off, cells[c].value);
+                    else
+                        bf_known_set(k, cur + cells[c].off,
+                                     w < 0 ? -1 : (w + cells[c].value * t) & mask);
+                }
+                i += insn->arg - 1;
+                break;
+            }
+            case BF_CLOSE:
+                k->len = 0;
+                k->rest_zero = false;
+                cur = 0;
+                bf_known_set(k, 0, 0);
+                break;
+        }
+    }
+
+    free(k);
+}
+
+/*
+ * Dump prog the way the native backends compile it after loop analysis:
+ * counted loops with a known trip count show as the cell updates they
+ * fold into, the others are marked if they get unrolled by factor. With
+ * a NULL f nothing is printed. Returns the number of instructions, folded
+ * updates counted as one each.
+ */
+static inline uint32_t
+bf_dump_loops(FILE *f, const struct bf_program *prog, unsigned cell, unsigned factor,
+              const int64_t *trips)
+{
+    struct bf_cell_effect cells[BF_COUNTED_MAX_BODY];
+    uint32_t mask = bf_cell_mask(cell);
+    uint32_t count = 0;
+    int depth = 0;
+
+    for (uint32_t i = 0; i < prog->len; i++) {
+        const struct bf_insn *insn = &prog->code[i];
+        uint32_t n;
+
+        if (insn->op == BF_CLOSE)
+            depth--;
+
+        if (insn->op == BF_OPEN && trips[i] != BF_TRIP_UNKNOWN &&
+            (n = bf_counted_loop(prog->code, i, cell, cells))) {
+            // a loop that never runs is dropped, nothing left to show
+            if (trips[i] == 0) {
+                if (f)
+                    fprintf(f, "%10u  %*sskipped, 0 trips\n", i, 2 * depth, "");
+                i += insn->arg - 1;
+                continue;
+            }
+            if (f)
+                fprintf(f, "%10u  %*sfolded, %ld trips\n", i, 2 * depth, "", (long)trips[i]);
+            for (uint32_t c = 0; c < n; c++) {
+                uint32_t value = cells[c].set ? cells[c].value
+                                              : (uint32_t)(cells[c].value * trips[i]) & mask;
+
+                if (!cells[c].set && !value)
+                    continue;
+                if (f)
+                    fprintf(f, "%10s  %*s%s [%+ld] %u\n", "", 2 * depth + 2, "",
+                            cells[c].set ? "set" : "add", (long)cells[c].off, value);
+                count++;
+            }
+            i += insn->arg - 1;
+            continue;
+        }
+
+        if (f) {
+            bf_dump_insn(f, prog->code, i, depth);
+            if (insn->op == BF_OPEN && factor > 1 && bf_counted_loop(prog->code, i, cell, cells))
+                fprintf(f, "%10s  %*s(counted, unrolled by %u)\n", "", 2 * depth + 2, "", factor);
+        }
+        if (insn->op == BF_OPEN)
+            depth++;
+        count++;
+    }
+
+    return count;
+}
+
+#endif
@@ -0,0 +1,125 @@
+#ifndef BF_PARALLEL_H
+#define BF_PARALLEL_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "bf_insn.h"
+
+/*
+ * Parallel compilation of big programs.
+ *
+ * Cut at top-level boundaries, a program falls into regions with every
+ * loop whole inside one of them, so no branch crosses from one region to
+ * another: code generated for a region only depends on the region, and
+ * code for different regions can be generated at the same time and laid
+ * out one after the other. Each backend plans and emits its regions on
+ * bf_parallel_for, then stitches them together in program order.
+ *
+ * A top-level loop bigger than the region size is one region on its
+ * own; programs made of one giant loop do not get any faster.
+ */
+
+#define BF_REGION_MIN 4096       /* instructions, below that threads cost more */
+#define BF_REGIONS_PER_JOB 4     /* so uneven regions still balance out */
+
+/* Number of threads for jobs, 0 meaning one per online CPU */
+static inline unsigned
+bf_jobs(unsigned jobs)
+{
+    if (jobs)
+        return jobs;
+
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (unsigned)n : 1;
+}
+
+/*
+ * Cut prog into regions of about len / (jobs * BF_REGIONS_PER_JOB)
+ * instructions, at least BF_REGION_MIN, ending only where no loop is
+ * open. Region k is code[bounds[k]..bounds[k + 1]); returns the number
+ * of regions, with *bounds holding one more entry, and never less than
+ * one region, however short the program.
+ */
+static inline uint32_t
+bf_regions(const struct bf_program *prog, unsigned jobs, uint32_t **bounds)
+{
+    uint32_t target = prog->len / (jobs * BF_REGIONS_PER_JOB);
+    uint32_t cap = 0;
+    uint32_t n = 0;
+    uint32_t *b = NULL;
+
+    if (target < BF_REGION_MIN)
+        target = BF_REGION_MIN;
+
+    b = (uint32_t *)grow_array(b, &cap, 1, sizeof(uint32_t));
+    b[0] = 0;
+
+    for (uint32_t i = 0; i < prog->len; i++) {
+        // loops are skipped whole, so i is always at the top level here
+        if (prog->code[i].op == BF_OPEN)
+            i += prog->code[i].arg - 1;
+
+        if (i + 1 - b[n] >= target && i + 1 < prog->len) {
+            b = (uint32_t *)grow_array(b, &cap, n + 2, sizeof(uint32_t));
+            b[++n] = i + 1;
+        }
+    }
+
+    b = (uint32_t *)grow_array(b, &cap, n + 2, sizeof(uint32_t));
+    b[++n] = prog->len;
+    *bounds = b;
+
+    return n;
+}
+
+struct bf_parallel {
+    void (*fn)(void *ctx, uint32_t k);
+    void *ctx;
+    uint32_t n;
+    uint32_t next;
+};
+
+static inline void *
+bf_parallel_worker(void *arg)
+{
+    struct bf_parallel *p = (struct bf_parallel *)arg;
+    uint32_t k;
+
+    while ((k = __atomic_fetch_add(&p->next, 1, __ATOMIC_RELAXED)) < p->n)
+        p->fn(p->ctx, k);
+
+    return NULL;
+}
+
+/*
+ * Run fn(ctx, k) for every k in [0, n) on up to jobs threads, the
+ * calling one included, handing out one k at a time. Returns when all
+ * of them are done. A single job, or a single k, runs inline; threads
+ * that cannot be created only leave more work to the others.
+ */
+static inline void
+bf_parallel_for(uint32_t n, unsigned jobs, void (*fn)(void *ctx, uint32_t k), void *ctx)
+{
+    struct bf_parallel p = { fn, ctx, n, 0 };
+    unsigned nthreads = jobs < n ? jobs : n;
+    pthread_t *threads = NULL;
+    unsigned started = 0;
+
+    if (nthreads > 1)
+        threads = (pthread_t *)malloc((nthreads - 1) * sizeof(pthread_t));
+
+    for (; threads && started < nthreads - 1; started++) {
+        if (pthread_create(&threads[started], NULL, bf_parallel_worker, &p) != 0)
+            break;
+    }
+
+    bf_parallel_worker(&p);
+
+    for (unsigned t = 0; t < started; t++)
+        pthread_join(threads[t], NULL);
+    free(threads);
+}
+
+#endif
@@ -0,0 +1,294 @@
+#ifndef BF_PERF_H
+#define BF_PERF_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "bf_insn.h"
+
+/*
+ * Symbols for JIT code, for Linux perf.
+ *
+ * The generated code is cut into regions at every bracket and each region
+ * is named after the innermost loop it belongs to, by the source range of
+ * that loop (byte offsets, as in the bfi profiler). Straight-line code
+ * outside of any loop is bf_main. Regions never overlap, so perf can
+ * attribute every sample.
+ *
+ * The perf map (/tmp/perf-<pid>.map) only carries symbols. The jitdump
+ * (jit-<pid>.dump, for perf inject --jit) additionally maps every
+ * instruction back to its line and column in the .bf file.
+ */
+
+#define JITDUMP_MAGIC 0x4A695444
+#define JITDUMP_VERSION 1
+#define JITDUMP_EM_X86_64 62
+#define JIT_CODE_LOAD 0
+#define JIT_CODE_DEBUG_INFO 2
+
+struct jitdump_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t total_size;
+  uint32_t elf_mach;
+  uint32_t pad1;
+  uint32_t pid;
+  uint64_t timestamp;
+  uint64_t flags;
+};
+
+struct jitdump_record {
+  uint32_t id;
+  uint32_t total_size;
+  uint64_t timestamp;
+};
+
+struct jitdump_code_load {
+  struct jitdump_record rec;
+  uint32_t pid;
+  uint32_t tid;
+  uint64_t vma;
+  uint64_t code_addr;
+  uint64_t code_size;
+  uint64_t code_index;
+};
+
+struct jitdump_debug_info {
+  struct jitdump_record rec;
+  uint64_t code_addr;
+  uint64_t nr_entry;
+};
+
+struct jitdump_debug_entry {
+  uint64_t addr;
+  uint32_t line;
+  uint32_t discrim;
+};
+
+/* One named, contiguous piece of JIT code covering insns [first, end) */
+struct perf_region {
+  uint32_t first;
+  uint32_t end;
+  uint32_t loop;   /* BF_OPEN of the innermost loop, or UINT32_MAX */
+};
+
+struct perf_jit {
+  FILE *map;
+  FILE *dump;
+  void *dump_marker;
+  size_t dump_marker_size;
+  const char *src_path;
+  uint64_t code_index;
+};
+
+static inline uint64_t
+perf_timestamp(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline int
+perf_jit_open(struct perf_jit *pj, bool map, bool dump, const char *src_path)
+{
+    char path[64];
+
+    memset(pj, 0, sizeof(*pj));
+    pj->src_path = src_path;
+
+    if (map) {
+        snprintf(path, sizeof(path), "/tmp/perf-%d.map", getpid());
+        pj->map = fopen(path, "w");
+        if (!pj->map) {
+            perror(path);
+            return -1;
+        }
+    }
+
+    if (dump) {
+        struct jitdump_header hdr;
+
+        snprintf(path, sizeof(path), "jit-%d.dump", getpid());
+        pj->dump = fopen(path, "w+");
+        if (!pj->dump) {
+            perror(path);
+            return -1;
+        }
+
+        /*
+         * perf record only notices the dump through an executable mapping
+         * of it, which perf inject then uses to find the file.
+         */
+        pj->dump_marker_size = sysconf(_SC_PAGESIZE);
+        pj->dump_marker = mmap(NULL, pj->dump_marker_size, PROT_READ | PROT_EXEC,
+                               MAP_PRIVATE, fileno(pj->dump), 0);
+        if (pj->dump_marker == MAP_FAILED)
+            pj->dump_marker = NULL;
+
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.magic = JITDUMP_MAGIC;
+        hdr.version = JITDUMP_VERSION;
+        hdr.total_size = sizeof(hdr);
+        hdr.elf_mach = JITDUMP_EM_X86_64;
+        hdr.pid = getpid();
+        hdr.timestamp = perf_timestamp();
+        fwrite(&hdr, sizeof(hdr), 1, pj->dump);
+    }
+
+    return 0;
+}
+
+static inline void
+perf_jit_close(struct perf_jit *pj)
+{
+    if (pj->map)
+        fclose(pj->map);
+    if (pj->dump_marker)
+        munmap(pj->dump_marker, pj->dump_marker_size);
+    if (pj->dump)
+        fclose(pj->dump);
+
+    pj->map = NULL;
+    pj->dump = NULL;
+    pj->dump_marker = NULL;
+}
+
+static inline void
+perf_region_name(const struct bf_program *prog, struct perf_region *r, char *name, size_t size)
+{
+    if (r->loop == UINT32_MAX) {
+        snprintf(name, size, "bf_main");
+        return;
+    }
+
+    uint32_t close = r->loop + prog->code[r->loop].arg - 1;
+    if (prog->pos)
+        snprintf(name, size, "bf_loop@%" PRIu64 "-%" PRIu64,
+                 prog->pos[r->loop].offset, prog->pos[close].offset);
+    else
+        snprintf(name, size, "bf_loop@insn%u-%u", r->loop, close);
+}
+
+static inline void
+perf_jit_region(struct perf_jit *pj, const struct bf_program *prog, struct perf_region *r,
+                const uint8_t *code, const uint32_t *insn_off, uint32_t start, uint32_t end)
+{
+    char name[96];
+
+    if (end <= start)
+        return;
+
+    perf_region_name(prog, r, name, sizeof(name));
+
+    if (pj->map)
+        fprintf(pj->map, "%" PRIxPTR " %x %s\n", (uintptr_t)(code + start), end - start, name);
+
+    if (!pj->dump)
+        return;
+
+    uint64_t timestamp = perf_timestamp();
+
+    if (prog->pos && r->end > r->first) {
+        struct jitdump_debug_info info;
+        size_t src_len = strlen(pj->src_path) + 1;
+        uint32_t n = r->end - r->first;
+
+        info.rec.id = JIT_CODE_DEBUG_INFO;
+        info.rec.total_size = sizeof(info) + n * (sizeof(struct jitdump_debug_entry) + src_len);
+        info.rec.timestamp = timestamp;
+        info.code_addr = (uint64_t)(uintptr_t)(code + start);
+        info.nr_entry = n;
+        fwrite(&info, sizeof(info), 1, pj->dump);
+
+        for (uint32_t i = r->first; i < r->end; i++) {
+            struct jitdump_debug_entry entry;
+
+            // the region's own prologue/epilogue code goes to its first line
+            entry.addr = (uint64_t)(uintptr_t)(code + (i == r->first ? start : insn_off[i]));
+            entry.line = prog->pos[i].line;
+            entry.discrim = prog->pos[i].col;
+            fwrite(&entry, sizeof(entry), 1, pj->dump);
+            fwrite(pj->src_path, src_len, 1, pj->dump);
+        }
+    }
+
+    struct jitdump_code_load load;
+    size_t name_len = strlen(name) + 1;
+
+    load.rec.id = JIT_CODE_LOAD;
+    load.rec.total_size = sizeof(load) + name_len + (end - start);
+    load.rec.timestamp = timestamp;
+    load.pid = getpid();
+    load.tid = syscall(SYS_gettid);
+    load.vma = (uint64_t)(uintptr_t)(code + start);
+    load.code_addr = load.vma;
+    load.code_size = end - start;
+    load.code_index = pj->code_index++;
+    fwrite(&load, sizeof(load), 1, pj->dump);
+    fwrite(name, name_len, 1, pj->dump);
+    fwrite(code + start, end - start, 1, pj->dump);
+}
+
+/*
+ * Describe JIT code at `code` to perf. insn_off[i] is the offset of the
+ * code for instruction i, insn_off[prog->len] the offset of the epilogue
+ * and code_size the size of everything.
+ */
+static inline void
+perf_jit_emit(struct perf_jit *pj, const struct bf_program *prog, const uint8_t *code,
+              const uint32_t *insn_off, uint32_t code_size)
+{
+    struct perf_region r;
+    uint32_t *loop_stack = NULL;
+    uint32_t loop_cap = 0;
+    uint32_t depth = 0;
+    uint32_t start = 0;
+
+    r.first = 0;
+    r.loop = UINT32_MAX;
+
+    for (uint32_t i = 0; i < prog->len; i++) {
+        uint32_t op = prog->code[i].op;
+
+        if (op != BF_OPEN && op != BF_CLOSE)
+            continue;
+
+        // a loop owns its '[' test and its ']' branch
+        uint32_t cut = op == BF_OPEN ? i : i + 1;
+
+        r.end = cut;
+        perf_jit_region(pj, prog, &r, code, insn_off, start, insn_off[cut]);
+
+        if (op == BF_OPEN) {
+            loop_stack = (uint32_t *)grow_array(loop_stack, &loop_cap, depth + 1, sizeof(uint32_t));
+            loop_stack[depth++] = i;
+        }
+        else {
+            depth--;
+        }
+
+        r.first = cut;
+        r.loop = depth ? loop_stack[depth - 1] : UINT32_MAX;
+        start = insn_off[cut];
+    }
+
+    // trailing straight-line code and the epilogue
+    r.end = prog->len;
+    perf_jit_region(pj, prog, &r, code, insn_off, start, code_size);
+
+    free(loop_stack);
+    if (pj->map)
+        fflush(pj->map);
+    if (pj->dump)
+        fflush(pj->dump);
+}
+
+#endif
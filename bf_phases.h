@@ -0,0 +1,113 @@
+#ifndef BF_PHASES_H
+#define BF_PHASES_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+/*
+ * Wall time and memory per phase of the compile pipeline (--time-phases).
+ *
+ * A phase ends at each bf_phase_end, which records the time since the
+ * previous one and the resident set size at that point. The report shows
+ * for every phase its time, the RSS it left behind and how much it grew
+ * or shrank it, then the peak RSS of the whole process.
+ */
+
+#define BF_MAX_PHASES 16
+
+struct bf_phase {
+    const char *name;
+    uint64_t ns;
+    int64_t rss;       /* bytes resident when the phase ended */
+};
+
+struct bf_phases {
+    struct bf_phase list[BF_MAX_PHASES];
+    unsigned n;
+    uint64_t mark;     /* when the current phase started */
+    int64_t rss_start;
+};
+
+static inline uint64_t
+bf_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Resident set size in bytes, from /proc/self/statm; -1 if unknown */
+static inline int64_t
+bf_rss(void)
+{
+    FILE *f = fopen("/proc/self/statm", "r");
+    long size, resident;
+    int n;
+
+    if (!f)
+        return -1;
+    n = fscanf(f, "%ld %ld", &size, &resident);
+    fclose(f);
+
+    return n == 2 ? (int64_t)resident * sysconf(_SC_PAGESIZE) : -1;
+}
+
+static inline void
+bf_phases_start(struct bf_phases *p)
+{
+    p->n = 0;
+    p->rss_start = bf_rss();
+    p->mark = bf_now_ns();
+}
+
+static inline void
+bf_phase_end(struct bf_phases *p, const char *name)
+{
+    uint64_t now = bf_now_ns();
+
+    if (p->n < BF_MAX_PHASES) {
+        p->list[p->n].name = name;
+        p->list[p->n].ns = now - p->mark;
+        p->list[p->n].rss = bf_rss();
+        p->n++;
+    }
+    p->mark = bf_now_ns();
+}
+
+/* Add the phases q timed inside the last phase of p, which starts anew */
+static inline void
+bf_phases_append(struct bf_phases *p, const struct bf_phases *q)
+{
+    for (unsigned k = 0; k < q->n && p->n < BF_MAX_PHASES; k++)
+        p->list[p->n++] = q->list[k];
+    p->mark = bf_now_ns();
+}
+
+static inline void
+bf_phases_report(FILE *f, const struct bf_phases *p)
+{
+    const double mib = 1024.0 * 1024.0;
+    int64_t prev = p->rss_start;
+    uint64_t total = 0;
+    struct rusage ru;
+
+    fprintf(f, "%-12s %12s %12s %12s\n", "phase", "time (ms)", "rss (MiB)", "delta (MiB)");
+    for (unsigned k = 0; k < p->n; k++) {
+        const struct bf_phase *ph = &p->list[k];
+
+        fprintf(f, "%-12s %12.3f %12.1f %+12.1f\n", ph->name, ph->ns / 1e6, ph->rss / mib,
+                (ph->rss - prev) / mib);
+        prev = ph->rss;
+        total += ph->ns;
+    }
+    fprintf(f, "%-12s %12.3f", "total", total / 1e6);
+    if (getrusage(RUSAGE_SELF, &ru) == 0)
+        fprintf(f, " %12.1f peak", ru.ru_maxrss / 1024.0);
+    fputc('\n', f);
+}
+
+#endif
@@ -0,0 +1,233 @@
+#ifndef BF_SAMPLER_H
+#define BF_SAMPLER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <ucontext.h>
+#include <sys/time.h>
+#include "bf_insn.h"
+
+/*
+ * Sampling profiler for JIT code.
+ *
+ * An ITIMER_PROF timer delivers SIGPROF every SAMPLER_INTERVAL_US of CPU
+ * time. The handler takes the interrupted rip and, if it lies in the JIT
+ * code, binary searches the per-instruction code offsets the JIT keeps
+ * to bump a counter for that BF instruction. Nothing else runs during
+ * execution, so the cost is one signal per interval.
+ *
+ * REG_RIP needs _GNU_SOURCE defined before the first system header.
+ *
+ * At exit the counts are folded into loops (self: samples in the loop's
+ * own code, total: including nested loops) and the hottest are printed.
+ */
+
+#define SAMPLER_INTERVAL_US 1000
+#define SAMPLER_REPORT_LOOPS 20
+#define SAMPLER_LOOP_TEXT 60
+
+struct sampler {
+  const uint8_t *code;
+  uint32_t code_size;
+  const uint32_t *insn_off;
+  uint32_t len;
+  uint64_t *samples;   /* per instruction, samples[len] is the epilogue */
+  uint64_t total;
+  uint64_t outside;    /* in libc, the kernel or anything not JIT code */
+};
+
+struct sampler_loop {
+  uint32_t open;
+  uint64_t self;
+  uint64_t total;
+};
+
+static struct sampler *active_sampler;
+
+static void
+sampler_handler(int sig, siginfo_t *info, void *ucontext)
+{
+    struct sampler *s = active_sampler;
+    ucontext_t *uc = (ucontext_t *)ucontext;
+    uintptr_t pc = uc->uc_mcontext.gregs[REG_RIP];
+
+    (void)sig;
+    (void)info;
+
+    if (!s)
+        return;
+
+    s->total++;
+
+    if (pc < (uintptr_t)s->code || pc >= (uintptr_t)s->code + s->code_size) {
+        s->outside++;
+        return;
+    }
+
+    // last instruction whose code starts at or before pc
+    uint32_t off = pc - (uintptr_t)s->code;
+    uint32_t lo = 0;
+    uint32_t hi = s->len + 1;
+
+    while (hi - lo > 1) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (s->insn_off[mid] <= off)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    s->samples[lo]++;
+}
+
+static inline int
+sampler_start(struct sampler *s, const uint8_t *code, uint32_t code_size,
+              const uint32_t *insn_off, uint32_t len)
+{
+    struct sigaction sa;
+    struct itimerval timer;
+
+    s->code = code;
+    s->code_size = code_size;
+    s->insn_off = insn_off;
+    s->len = len;
+    s->samples = (uint64_t *)calloc(len + 1, sizeof(uint64_t));
+    s->total = 0;
+    s->outside = 0;
+    active_sampler = s;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = sampler_handler;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGPROF, &sa, NULL) != 0) {
+        perror("sigaction");
+        return -1;
+    }
+
+    timer.it_interval.tv_sec = 0;
+    timer.it_interval.tv_usec = SAMPLER_INTERVAL_US;
+    timer.it_value = timer.it_interval;
+    if (setitimer(ITIMER_PROF, &timer, NULL) != 0) {
+        perror("setitimer");
+        return -1;
+    }
+
+    return 0;
+}
+
+static inline void
+sampler_stop(struct sampler *s)
+{
+    struct itimerval timer;
+
+    memset(&timer, 0, sizeof(timer));
+    setitimer(ITIMER_PROF, &timer, NULL);
+    signal(SIGPROF, SIG_IGN);
+    active_sampler = NULL;
+    (void)s;
+}
+
+static inline int
+sampler_compare(const void *a, const void *b)
+{
+    const struct sampler_loop *l1 = (const struct sampler_loop *)a;
+    const struct sampler_loop *l2 = (const struct sampler_loop *)b;
+
+    if (l1->self != l2->self)
+        return l1->self < l2->self ? 1 : -1;
+    return l1->total < l2->total ? 1 : l1->total > l2->total ? -1 : 0;
+}
+
+static inline void
+sampler_loop_name(const struct bf_program *prog, uint32_t open, char *name, size_t size)
+{
+    uint32_t close = open + prog->code[open].arg - 1;
+
+    if (prog->pos)
+        snprintf(name, size, "%" PRIu64 "-%" PRIu64,
+                 prog->pos[open].offset, prog->pos[close].offset);
+    else
+        snprintf(name, size, "insn %u-%u", open, close);
+}
+
+/* Print the hot-loop report to f */
+static inline void
+sampler_report(struct sampler *s, const struct bf_program *prog, FILE *f)
+{
+    struct sampler_loop *loops = NULL;
+    uint32_t loops_cap = 0;
+    uint32_t total_loops = 0;
+    uint32_t *stack = NULL;
+    uint32_t stack_cap = 0;
+    uint32_t depth = 0;
+    uint64_t main_self = s->samples[prog->len];
+
+    for (uint32_t i = 0; i < prog->len; i++) {
+        uint64_t n = s->samples[i];
+
+        if (prog->code[i].op == BF_OPEN) {
+            loops = (struct sampler_loop *)grow_array(loops, &loops_cap, total_loops + 1,
+                                                      sizeof(struct sampler_loop));
+            stack = (uint32_t *)grow_array(stack, &stack_cap, depth + 1, sizeof(uint32_t));
+            loops[total_loops].open = i;
+            loops[total_loops].self = 0;
+            loops[total_loops].total = 0;
+            stack[depth++] = total_loops++;
+        }
+
+        if (depth) {
+            loops[stack[depth - 1]].self += n;
+            loops[stack[depth - 1]].total += n;
+        }
+        else {
+            main_self += n;
+        }
+
+        if (prog->code[i].op == BF_CLOSE) {
+            uint32_t done = stack[--depth];
+            if (depth)
+                loops[stack[depth - 1]].total += loops[done].total;
+        }
+    }
+
+    qsort(loops, total_loops, sizeof(struct sampler_loop), sampler_compare);
+
+    uint64_t total = s->total ? s->total : 1;
+
+    fprintf(f, "\n\n ====== SAMPLES ======\n\n");
+    fprintf(f, "%" PRIu64 " samples every %d us, %" PRIu64 " outside JIT code\n",
+            s->total, SAMPLER_INTERVAL_US, s->outside);
+    fprintf(f, "top level => %" PRIu64 " (%.1f%%)\n\n", main_self, 100.0 * main_self / total);
+    fprintf(f, "Hot loops (source range: self / total):\n");
+
+    for (uint32_t i = 0; i < total_loops && i < SAMPLER_REPORT_LOOPS; i++) {
+        struct sampler_loop *l = &loops[i];
+        char name[64];
+
+        if (!l->self)
+            break;
+
+        sampler_loop_name(prog, l->open, name, sizeof(name));
+        fprintf(f, "%s: %" PRIu64 " (%.1f%%) / %" PRIu64 " (%.1f%%) ", name,
+                l->self, 100.0 * l->self / total, l->total, 100.0 * l->total / total);
+        bf_print_insns(f, prog->code, l->open, l->open + prog->code[l->open].arg - 1,
+                       SAMPLER_LOOP_TEXT);
+        fprintf(f, "\n");
+    }
+
+    free(loops);
+    free(stack);
+}
+
+static inline void
+sampler_free(struct sampler *s)
+{
+    free(s->samples);
+    s->samples = NULL;
+}
+
+#endif
@@ -0,0 +1,425 @@
+#ifndef BF_TRACE_H
+#define BF_TRACE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "bf_insn.h"
+#include "bf_jit_x86_64.h"
+
+/*
+ * Trace compiler for hot loops.
+ *
+ * Once the back edge of a loop has been taken TRACE_HOT times, the next
+ * iteration is interpreted while recording every instruction executed
+ * and which way every bracket went. Inner loops are recorded unrolled,
+ * as many times as they actually ran, so loops whose shape depends on
+ * the data still come out as one straight line.
+ *
+ * The trace is compiled with the pointer movements folded away: every
+ * cell access uses a constant displacement from the pointer at the top
+ * of the iteration and the pointer itself only moves once, by the net
+ * drift, at the back edge. Each recorded bracket becomes a guard; when
+ * the data goes the other way the trace stores the real pointer and
+ * returns the bracket to the interpreter, which carries on from there.
+ * The pointer range the iteration touches is checked once at its top,
+ * an iteration that would leave the tape runs interpreted instead and
+ * reports the error there.
+ *
+ * A trace is uint32_t fn(unsigned char **ptr, unsigned char *tape,
+ * unsigned char *tape_end); it returns the instruction to continue at.
+ * Recording gives up on I/O and on traces over TRACE_MAX_INSNS, such
+ * loops stay interpreted. Recording is done by trace_record in
+ * bf_engines.h, which exists once per cell width like the interpreters;
+ * the compiler here takes the width and keeps drifts in bytes.
+ */
+
+#define TRACE_HOT 64
+#define TRACE_MAX_INSNS 4096
+#define TRACE_MAX_DRIFT (1 << 30)    /* bytes */
+
+/* Trace entry for an inner loop run by its own trace, arg is its close */
+#define TRACE_CALL 16
+
+/* Exit stub for a called trace's exit, rax and the pointer are set */
+#define TRACE_EXIT_RET UINT32_MAX
+
+typedef uint32_t (*trace_fn)(unsigned char **ptr, unsigned char *tape, unsigned char *tape_end);
+
+/* A guard's jump, patched to its exit stub once the body is emitted */
+struct trace_exit {
+  uint32_t patch;
+  uint32_t pc;
+  intptr_t drift;
+};
+
+/*
+ * Per-run state of the tracing engine, per instruction: the loop trace
+ * of the loop closed there, or the side trace starting there after a
+ * guard of the trace of loop `anchor` failed.
+ */
+struct trace_slot {
+  trace_fn fn;
+  size_t map_size;
+  uint32_t hits;
+  uint32_t anchor;
+  bool failed;
+
+  /* exit stubs not linked to a side trace yet, patch is the link area */
+  struct trace_exit *exits;
+  uint32_t exits_len;
+  uint32_t exits_cap;
+
+  /* loop traces: where the side traces anchored here start */
+  uint32_t *sides;
+  uint32_t sides_len;
+  uint32_t sides_cap;
+};
+
+struct trace_entry {
+  uint32_t pc;
+  uint32_t op;
+  intptr_t arg;
+  trace_fn fn;     /* TRACE_CALL */
+  bool nonzero;    /* brackets: the cell tested was not zero */
+};
+
+struct trace {
+  struct trace_entry *entries;
+  uint32_t len;
+  uint32_t cap;
+};
+
+/* lea rcx, [rcx+drift] */
+static inline void
+trace_emit_move(struct jit_state *state, intptr_t drift)
+{
+    if (!drift)
+        return;
+    emit1(state, 0x48);
+    emit1(state, 0x8d);
+    emit1(state, 0x89);
+    emit4(state, (uint32_t)drift);
+}
+
+/* mov rax, target ; jmp rax, the 12 bytes of a linked exit */
+static inline void
+trace_emit_jump(uint8_t *buf, trace_fn target)
+{
+    uint64_t addr = (uint64_t)(uintptr_t)target;
+
+    buf[0] = 0x48;
+    buf[1] = 0xb8;
+    memcpy(buf + 2, &addr, sizeof(addr));
+    buf[10] = 0xff;
+    buf[11] = 0xe0;
+}
+
+/*
+ * lea rcx, [rcx+drift] ; mov [rdi], rcx ; then either mov eax, pc ; ret
+ * padded to 12 bytes, which trace_link can overwrite with a jump to a
+ * side trace, or that jump right away. Returns the offset of the 12 bytes.
+ */
+static inline uint32_t
+trace_emit_stub(struct jit_state *state, uint32_t pc, intptr_t drift, trace_fn target)
+{
+    static const uint8_t nops[6] = { 0x90, 0x90, 0x90, 0x90, 0x90, 0x90 };
+    uint8_t jump[12];
+
+    trace_emit_move(state, drift);
+    emit1(state, 0x48);
+    emit1(state, 0x89);
+    emit1(state, 0x0f);
+
+    uint32_t link = state->offset;
+    if (target) {
+        trace_emit_jump(jump, target);
+        emit_bytes(state, jump, sizeof(jump));
+    }
+    else {
+        emit1(state, 0xb8);
+        emit4(state, pc);
+        emit1(state, 0xc3);
+        emit_bytes(state, (void *)nops, sizeof(nops));
+    }
+
+    return link;
+}
+
+/* jcc rel32 to an exit stub, recorded for patching */
+static inline void
+trace_emit_exit(struct jit_state *state, struct trace_exit **exits, uint32_t *exits_len,
+                uint32_t *exits_cap, uint8_t jcc, uint32_t pc, intptr_t drift)
+{
+    emit1(state, 0x0f);
+    emit1(state, jcc);
+    *exits = (struct trace_exit *)grow_array(*exits, exits_cap, *exits_len + 1,
+                                             sizeof(struct trace_exit));
+    (*exits)[*exits_len].patch = state->offset;
+    (*exits)[*exits_len].pc = pc;
+    (*exits)[*exits_len].drift = drift;
+    (*exits_len)++;
+    emit4(state, 0);
+}
+
+/*
+ * Pointer range of the straight-line segment of t from entry k up to the
+ * next call or the end, in bytes. False if it drifts too far to fold.
+ */
+static inline bool
+trace_segment_range(const struct trace *t, uint32_t k, uint32_t cell, intptr_t *lo,
+                    intptr_t *hi)
+{
+    intptr_t drift = 0;
+
+    *lo = 0;
+    *hi = 0;
+    for (; k < t->len && t->entries[k].op != TRACE_CALL; k++) {
+        if (t->entries[k].op == BF_RIGHT)
+            drift += t->entries[k].arg * cell;
+        else if (t->entries[k].op == BF_LEFT)
+            drift -= t->entries[k].arg * cell;
+        if (drift > TRACE_MAX_DRIFT || drift < -TRACE_MAX_DRIFT)
+            return false;
+        *lo = drift < *lo ? drift : *lo;
+        *hi = drift > *hi ? drift : *hi;
+    }
+
+    return true;
+}
+
+/*
+ * Compile a trace recorded from start up to the loop's close into slot.
+ * A loop trace (start is the first instruction of the body) runs
+ * iterations until the loop ends. A side trace goes on with the loop
+ * trace at the end of its path, or returns close + 1 if the loop is
+ * done. Exits to places that already have a side trace of the same loop
+ * jump straight there. Cells are cell bytes wide. Returns false if the
+ * trace drifts too far to fold or code memory could not be mapped.
+ */
+static inline bool
+trace_compile(const struct trace *t, uint32_t start, uint32_t close, bool loop, uint32_t cell,
+              const struct trace_slot *loops, const struct trace_slot *sides,
+              struct trace_slot *slot)
+{
+    struct jit_state state;
+    struct trace_exit *exits = NULL;
+    uint32_t exits_len = 0;
+    uint32_t exits_cap = 0;
+    intptr_t drift = 0;
+    uint32_t segment = start;
+    uint32_t k = 0;
+
+    state.buf = (uint8_t *)malloc(JIT_INITIAL_SIZE);
+    state.size = JIT_INITIAL_SIZE;
+    state.offset = 0;
+    state.cell = cell;
+
+    // mov rcx, [rdi] ;cell pointer
+    emit1(&state, 0x48);
+    emit1(&state, 0x8b);
+    emit1(&state, 0x0f);
+
+    uint32_t head = state.offset;
+
+    for (;;) {
+        intptr_t lo, hi;
+
+        if (!trace_segment_range(t, k, cell, &lo, &hi)) {
+            free(state.buf);
+            free(exits);
+            return false;
+        }
+
+        // lea rax, [rcx+lo] ; cmp rax, rsi ; jb exit
+        emit1(&state, 0x48);
+        emit1(&state, 0x8d);
+        emit1(&state, 0x81);
+        emit4(&state, (uint32_t)lo);
+        emit1(&state, 0x48);
+        emit1(&state, 0x39);
+        emit1(&state, 0xf0);
+        trace_emit_exit(&state, &exits, &exits_len, &exits_cap, 0x82, segment, 0);
+
+        // lea rax, [rcx+hi] ; cmp rax, rdx ; jae exit
+        emit1(&state, 0x48);
+        emit1(&state, 0x8d);
+        emit1(&state, 0x81);
+        emit4(&state, (uint32_t)hi);
+        emit1(&state, 0x48);
+        emit1(&state, 0x39);
+        emit1(&state, 0xd0);
+        trace_emit_exit(&state, &exits, &exits_len, &exits_cap, 0x83, segment, 0);
+
+        for (drift = 0; k < t->len && t->entries[k].op != TRACE_CALL; k++) {
+            const struct trace_entry *e = &t->entries[k];
+
+            switch (e->op) {
+                case BF_RIGHT:
+                    drift += e->arg * cell;
+                    break;
+                case BF_LEFT:
+                    drift -= e->arg * cell;
+                    break;
+                case BF_INC:
+                    // add [rcx+drift], arg
+                    emit_cell_alu(&state, 0, RCX, drift, e->arg & bf_cell_mask(cell));
+                    break;
+                case BF_DEC:
+                    // sub [rcx+drift], arg
+                    emit_cell_alu(&state, 5, RCX, drift, e->arg & bf_cell_mask(cell));
+                    break;
+                case BF_CLEAR:
+                    // mov [rcx+drift], 0
+                    emit_cell_mov(&state, RCX, drift, 0);
+                    break;
+                case BF_OPEN:
+                case BF_CLOSE:
+                    // cmp [rcx+drift], 0 ; leave on the way not recorded
+                    emit_cell_alu(&state, 7, RCX, drift, 0);
+                    trace_emit_exit(&state, &exits, &exits_len, &exits_cap,
+                                    e->nonzero ? 0x84 : 0x85, e->pc, drift);
+                    break;
+            }
+        }
+
+        if (k == t->len)
+            break;
+
+        /*
+         * Inner loop with a trace of its own: cmp [rcx], 0 ; je over ;
+         * mov [rdi], rcx ; mov rax, fn ; call rax ; cmp eax, close + 1 ;
+         * jne ret ; mov rcx, [rdi]. Traces only touch rax and rcx, so
+         * rdi, rsi and rdx survive the call.
+         */
+        const struct trace_entry *e = &t->entries[k++];
+        uint32_t over;
+
+        trace_emit_move(&state, drift);
+        emit_cell_alu(&state, 7, RCX, 0, 0);
+        emit1(&state, 0x0f);
+        emit1(&state, 0x84);
+        over = state.offset;
+        emit4(&state, 0);
+        emit1(&state, 0x48);
+        emit1(&state, 0x89);
+        emit1(&state, 0x0f);
+        emit1(&state, 0x48);
+        emit1(&state, 0xb8);
+        uint64_t target = (uint64_t)(uintptr_t)e->fn;
+        emit_bytes(&state, &target, sizeof(target));
+        emit1(&state, 0xff);
+        emit1(&state, 0xd0);
+        emit1(&state, 0x3d);
+        emit4(&state, (uint32_t)e->arg + 1);
+        trace_emit_exit(&state, &exits, &exits_len, &exits_cap, 0x85, TRACE_EXIT_RET, 0);
+        emit1(&state, 0x48);
+        emit1(&state, 0x8b);
+        emit1(&state, 0x0f);
+
+        uint32_t rel = state.offset - (over + 4);
+        memcpy(state.buf + over, &rel, 4);
+        segment = e->arg + 1;
+    }
+
+    // lea rcx, [rcx+drift] ; cmp [rcx], 0
+    trace_emit_move(&state, drift);
+    emit_cell_alu(&state, 7, RCX, 0, 0);
+
+    if (loop) {
+        // jne head
+        emit1(&state, 0x0f);
+        emit1(&state, 0x85);
+        emit4(&state, head - (state.offset + 4));
+    }
+    else {
+        // je done ; mov [rdi], rcx ; jmp loop trace
+        trace_emit_exit(&state, &exits, &exits_len, &exits_cap, 0x84, close + 1, 0);
+        trace_emit_stub(&state, close, 0, loops[close].fn);
+    }
+
+    // the loop is done, continue after its ']'
+    if (loop)
+        trace_emit_stub(&state, close + 1, 0, NULL);
+
+    slot->exits_len = 0;
+    for (k = 0; k < exits_len; k++) {
+        struct trace_exit *x = &exits[k];
+        uint32_t rel = state.offset - (x->patch + 4);
+        trace_fn target = NULL;
+
+        memcpy(state.buf + x->patch, &rel, 4);
+
+        if (x->pc == TRACE_EXIT_RET) {
+            emit1(&state, 0xc3);
+            continue;
+        }
+
+        // never into itself, that exit is a side trace failing its first guard
+        if (x->pc != start && sides[x->pc].fn && sides[x->pc].anchor == close)
+            target = sides[x->pc].fn;
+
+        uint32_t link = trace_emit_stub(&state, x->pc, x->drift, target);
+        if (!target && x->pc != start && x->pc != close + 1) {
+            slot->exits = (struct trace_exit *)grow_array(slot->exits, &slot->exits_cap,
+                                                          slot->exits_len + 1,
+                                                          sizeof(struct trace_exit));
+            slot->exits[slot->exits_len].patch = link;
+            slot->exits[slot->exits_len].pc = x->pc;
+            slot->exits_len++;
+        }
+    }
+    free(exits);
+
+    size_t map_size = state.offset;
+    void *code = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) {
+        free(state.buf);
+        return false;
+    }
+    memcpy(code, state.buf, state.offset);
+    free(state.buf);
+
+    if (mprotect(code, map_size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(code, map_size);
+        return false;
+    }
+
+    slot->fn = (trace_fn)code;
+    slot->map_size = map_size;
+    return true;
+}
+
+/*
+ * Point the exits of from to pc at the side trace to, so they no longer
+ * go through the interpreter. The code is flipped to writable and back,
+ * it is never writable and executable at once.
+ */
+static inline void
+trace_link(struct trace_slot *from, uint32_t pc, trace_fn to)
+{
+    bool writable = false;
+
+    for (uint32_t k = 0; k < from->exits_len; k++) {
+        struct trace_exit *x = &from->exits[k];
+
+        if (x->pc != pc)
+            continue;
+
+        if (!writable &&
+            mprotect((void *)from->fn, from->map_size, PROT_READ | PROT_WRITE) != 0)
+            return;
+        writable = true;
+
+        trace_emit_jump((uint8_t *)from->fn + x->patch, to);
+        from->exits[k] = from->exits[--from->exits_len];
+        k--;
+    }
+
+    if (writable)
+        mprotect((void *)from->fn, from->map_size, PROT_READ | PROT_EXEC);
+}
+
+#endif
@@ -1,21 +1,38 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <getopt.h>
 #include <stdbool.h>
-#include <sys/mman.h>
-#include "bf_jit_x86_64.h"
+#include "brainfused.h"
+#include "bf_insn.h"
+#include "bf_perf.h"
+#include "bf_sampler.h"
+#include "bf_loops.h"
+#include "bf_parallel.h"
+#include "bf_phases.h"
 
 #define TAP_SIZE 1048576
 
-#define HALT 0
-#define BF_RIGHT 1
-#define BF_LEFT 2
-#define BF_INC 3
-#define BF_DEC 4
-#define BF_OUT 5
-#define BF_IN 6
-#define BF_OPEN 7
-#define BF_CLOSE 8
+static bool hugepages = false;
+static bool perf_map = false;
+static bool jitdump = false;
+static bool sample = false;
+static bool lazy = false;
+static const char *src_path;
+static const char *save_snapshot;
+static const char *resume;
+static uint64_t snapshot_steps;
+static unsigned unroll = BF_DEFAULT_UNROLL;
+static unsigned cell = 1;
+static unsigned jobs = 0;
+static bool time_phases = false;
+static struct bf_phases phases;
+static const char *dump_ir;
+
+static void phase(const char *name) {
+  if (time_phases)
+    bf_phase_end(&phases, name);
+}
 
 void gen_prologue(FILE *ofile) {
   fprintf(ofile,
@@ -37,6 +54,11 @@ void gen_prologue(FILE *ofile) {
   );
 }
 
+/* nasm operand size of a cell */
+static const char *cell_size(void) {
+  return cell == 4 ? "dword" : cell == 2 ? "word" : "byte";
+}
+
 void gen_epilogue(FILE *ofile) {
   fprintf(ofile,
     "\tmov rax, 60\n"
@@ -45,31 +67,103 @@ void gen_epilogue(FILE *ofile) {
   );
 }
 
-int bf_aot_comp(unsigned char *code, FILE *ofile) {
-  int loop_stack[100];
-  int loop_stack_pos = 0;
-  int loop_count = 0;
-  gen_prologue(ofile);
-  
-  while(*code) {
-    switch(*code) {
-      case '>':
-        fprintf(ofile, "\tinc rsi\n");
+/* k iterations of a counted loop folded into one block */
+void gen_cells(FILE *ofile, struct bf_cell_effect *cells, uint32_t n, uint32_t k) {
+  // no iterations change no cell, set ones included
+  if (k == 0)
+    return;
+
+  for (uint32_t c = 0; c < n; c++) {
+    uint32_t value = (cells[c].set ? cells[c].value : cells[c].value * k) & bf_cell_mask(cell);
+    char addr[32];
+
+    if (cells[c].off)
+      snprintf(addr, sizeof(addr), "[rsi%+ld]", (long)cells[c].off * cell);
+    else
+      snprintf(addr, sizeof(addr), "[rsi]");
+
+    if (cells[c].set)
+      fprintf(ofile, "\tmov %s %s, %u\n", cell_size(), addr, value);
+    else if (value)
+      fprintf(ofile, "\tadd %s %s, %u\n", cell_size(), addr, value);
+  }
+}
+
+/*
+ * Counted loops (bf_loops.h): folded away when the trip count is known,
+ * otherwise unrolled by factor as in the JIT, single iterations until
+ * the counter is a multiple of factor, then groups with one test each.
+ */
+void gen_counted(FILE *ofile, int i, struct bf_cell_effect *cells, uint32_t n, int64_t trips,
+                 unsigned factor) {
+  if (trips != BF_TRIP_UNKNOWN) {
+    // a loop that never runs leaves every cell as it is
+    if (trips > 0)
+      gen_cells(ofile, cells, n, trips);
+    return;
+  }
+
+  fprintf(ofile, "\ttest %s [rsi], %u\n", cell_size(), factor - 1);
+  fprintf(ofile, "\tjz loop_group_test_%d\n", i);
+  fprintf(ofile, "loop_rem_%d:\n", i);
+  gen_cells(ofile, cells, n, 1);
+  fprintf(ofile, "\ttest %s [rsi], %u\n", cell_size(), factor - 1);
+  fprintf(ofile, "\tjnz loop_rem_%d\n", i);
+  fprintf(ofile, "loop_group_test_%d:\n", i);
+  fprintf(ofile, "\tcmp %s [rsi], 0\n", cell_size());
+  fprintf(ofile, "\tje loop_end_%d\n", i);
+  fprintf(ofile, "loop_start_%d:\n", i);
+  gen_cells(ofile, cells, n, factor);
+  fprintf(ofile, "\tcmp %s [rsi], 0\n", cell_size());
+  fprintf(ofile, "\tjne loop_start_%d\n", i);
+  fprintf(ofile, "loop_end_%d:\n", i);
+}
+
+/* Assembly for code[start..end), loops are labelled by the index of their '[' */
+void gen_range(FILE *ofile, const struct bf_program *prog, const int64_t *trips,
+               unsigned factor, uint32_t start, uint32_t end) {
+  const struct bf_insn *code = prog->code;
+  struct bf_cell_effect cells[BF_COUNTED_MAX_BODY];
+
+  for (int i = start; i < (int)end; i++) {
+    intptr_t arg = code[i].arg;
+    uint32_t n;
+
+    switch(code[i].op) {
+      case BF_RIGHT:
+        if (arg * cell == 1)
+          fprintf(ofile, "\tinc rsi\n");
+        else
+          fprintf(ofile, "\tadd rsi, %ld\n", (long)arg * cell);
         break;
       
-      case '<':
-        fprintf(ofile, "\tdec rsi\n");
+      case BF_LEFT:
+        if (arg * cell == 1)
+          fprintf(ofile, "\tdec rsi\n");
+        else
+          fprintf(ofile, "\tsub rsi, %ld\n", (long)arg * cell);
         break;
       
-      case '+':
-        fprintf(ofile, "\tinc byte [rsi]\n");
+      case BF_INC:
+        if (arg == 1)
+          fprintf(ofile, "\tinc %s [rsi]\n", cell_size());
+        else
+          fprintf(ofile, "\tadd %s [rsi], %u\n", cell_size(), (uint32_t)arg & bf_cell_mask(cell));
         break;
       
-      case '-':
-        fprintf(ofile, "\tdec byte [rsi]\n");
+      case BF_DEC:
+        if (arg == 1)
+          fprintf(ofile, "\tdec %s [rsi]\n", cell_size());
+        else
+          fprintf(ofile, "\tsub %s [rsi], %u\n", cell_size(), (uint32_t)arg & bf_cell_mask(cell));
+        break;
+
+      case BF_CLEAR:
+        fprintf(ofile, "\tmov %s [rsi], 0\n", cell_size());
         break;
       
-      case '.':
+      // writes the low byte of the cell, which comes first
+      case BF_OUT:
         fprintf(ofile,
           "\tmov rax, 1\n"
           "\tmov rdi, 1\n"
@@ -78,186 +172,231 @@ int bf_aot_comp(unsigned char *code, FILE *ofile) {
         );
         break;
       
-      case ',':
+      case BF_IN:
         break;
       
-      case '[':
-        loop_stack[loop_stack_pos++] = loop_count;
-
-        fprintf(ofile, "loop_start_%d:\n", loop_count);
-        fprintf(ofile, "\tcmp byte [rsi], 0\n");
-        fprintf(ofile, "\tje loop_end_%d\n", loop_count);
-        loop_count++;
+      case BF_OPEN:
+        n = bf_counted_loop(code, i, cell, cells);
+        if (n && (trips[i] != BF_TRIP_UNKNOWN || factor > 1)) {
+          gen_counted(ofile, i, cells, n, trips[i], factor);
+          i += arg - 1;
+          break;
+        }
+        // the test here only guards entry, the loop is tested at its bottom
+        fprintf(ofile, "\tcmp %s [rsi], 0\n", cell_size());
+        fprintf(ofile, "\tje loop_end_%d\n", i);
+        fprintf(ofile, "loop_start_%d:\n", i);
         break;
       
-      case ']':
-        loop_stack_pos--;
-        int cur_loop_count = loop_stack[loop_stack_pos];
-        fprintf(ofile, "\tcmp byte [rsi], 0\n");
-        fprintf(ofile, "\tjne loop_start_%d\n", cur_loop_count);
-        fprintf(ofile, "loop_end_%d:\n", cur_loop_count);
+      case BF_CLOSE: {
+        int open = i + arg - 1;
+        fprintf(ofile, "\tcmp %s [rsi], 0\n", cell_size());
+        fprintf(ofile, "\tjne loop_start_%d\n", open);
+        fprintf(ofile, "loop_end_%d:\n", open);
         break;
+      }
 
       default:
         break;
     }
-
-    code++;
   }
+}
 
+/* Regions of the program (see bf_parallel.h) compiled to assembly in memory */
+struct aot_regions {
+  const struct bf_program *prog;
+  const int64_t *trips;
+  const uint32_t *bounds;
+  unsigned factor;
+  char **text;
+  size_t *text_len;
+};
+
+void aot_region(void *ctx, uint32_t k) {
+  struct aot_regions *r = (struct aot_regions *)ctx;
+  FILE *f = open_memstream(&r->text[k], &r->text_len[k]);
+
+  if (!f)
+    return;
+  gen_range(f, r->prog, r->trips, r->factor, r->bounds[k], r->bounds[k + 1]);
+  fclose(f);
+}
+
+int bf_aot_comp(const struct bf_program *prog, unsigned factor, FILE *ofile) {
+  unsigned threads = bf_jobs(jobs);
+  int64_t *trips = (int64_t *)malloc((prog->len + 1) * sizeof(int64_t));
+  uint32_t *bounds;
+  uint32_t nregions = bf_regions(prog, threads, &bounds);
+  struct aot_regions r = {
+    prog, trips, bounds, factor,
+    (char **)calloc(nregions, sizeof(char *)),
+    (size_t *)calloc(nregions, sizeof(size_t)),
+  };
+  int rv = 0;
+
+  bf_known_trips(prog, cell, trips);
+  phase("loops");
+  bf_parallel_for(nregions, threads, aot_region, &r);
+  phase("codegen");
+
+  // stitched in program order, labels are unique across regions
+  gen_prologue(ofile);
+  for (uint32_t k = 0; k < nregions; k++) {
+    if (!r.text[k] || fwrite(r.text[k], 1, r.text_len[k], ofile) != r.text_len[k])
+      rv = -1;
+    free(r.text[k]);
+  }
   gen_epilogue(ofile);
+  phase("write");
 
-  return 0;
+  free(r.text);
+  free(r.text_len);
+  free(bounds);
+  free(trips);
+
+  return rv;
 }
 
-uint32_t compute_pc_rel32(uint32_t from, uint32_t to) {
-  if (to >= from)
-    return to - from;
-  else
-    return ~(from - to) + 1;
+static bool dump_stage(const char *stage) {
+  return strcmp(dump_ir, stage) == 0 || strcmp(dump_ir, "all") == 0;
 }
 
-void replace_bytes(uint8_t *buf, uint32_t offset, uint32_t value, int size) {
-  for (int i = 0; i < size; i++) {
-    buf[offset + i] = (value >> (i * 8)) & 0xff;
-  }
+/*
+ * --dump-ir: the instruction stream after each pass, to stderr, with the
+ * counts going into and coming out of it. The parser folds runs and
+ * clear loops in its one pass over the source, so the stream before the
+ * idioms comes from parsing the source again without them.
+ */
+int dump_passes(const struct bf_program *prog, int parse_flags) {
+  struct bf_program raw;
+  uint64_t commands = 0;
+
+  if (bf_load_source(src_path, parse_flags & ~BF_PARSE_IDIOMS, &raw) != 0)
+    return -1;
+
+  for (uint32_t i = 0; i < raw.len; i++)
+    commands += raw.code[i].op >= BF_RIGHT && raw.code[i].op <= BF_DEC ? raw.code[i].arg : 1;
+
+  fprintf(stderr, ";; parse: %lu commands -> %u instructions\n", (unsigned long)commands, raw.len);
+  if (dump_stage("parse"))
+    bf_dump_program(stderr, &raw);
+
+  fprintf(stderr, ";; idioms: %u -> %u instructions\n", raw.len, prog->len);
+  if (dump_stage("idioms"))
+    bf_dump_program(stderr, prog);
+
+  int64_t *trips = (int64_t *)malloc((prog->len + 1) * sizeof(int64_t));
+  bf_known_trips(prog, cell, trips);
+  fprintf(stderr, ";; loops: %u -> %u instructions\n", prog->len,
+          bf_dump_loops(NULL, prog, cell, unroll, trips));
+  if (dump_stage("loops"))
+    bf_dump_loops(stderr, prog, cell, unroll, trips);
+
+  free(trips);
+  bf_program_free(&raw);
+
+  return 0;
 }
 
-void bf_jit_com_x86_64(unsigned char *code, int len) {
-  struct jit_state state;
-  
-  state.buf = (uint8_t *)malloc(MAX_OFFSET);
-  state.offset = 0;
-
-  uint32_t open_bracket_off[MAX_NESTING];
-  uint32_t open_br_off;
-  uint32_t open_bracket_index = 0;
-
-  // push callee saved registers
-  emit_push(&state, RBX);
-  emit_push(&state, RBP);
-  emit_push(&state, R12);
-  emit_push(&state, R13);
-  emit_push(&state, R14);
-  emit_push(&state, R15);
-
-  for (int i = 0; i < len; i++) {
-    switch(code[i]) {
-      case '>':
-        /*
-         * Tape is supplied as a pointer by the called in rdi
-         * 
-         * inc rdi
-         */
-        emit1(&state, 0x48);
-        emit1(&state, 0xff);
-        emit1(&state, 0xc7);
-        break;
+void perf_emit(const struct bf_program *prog, const uint8_t *code, const uint32_t *insn_off,
+               uint32_t code_size) {
+  struct perf_jit pj;
 
-      case '<':
-        // dec rdi
-        emit1(&state, 0x48);
-        emit1(&state, 0xff);
-        emit1(&state, 0xcf);
-        break;
+  if (perf_jit_open(&pj, perf_map, jitdump, src_path) == 0)
+    perf_jit_emit(&pj, prog, code, insn_off, code_size);
+  perf_jit_close(&pj);
+}
 
-      case '+':
-        // inc byte [rdi]
-        emit1(&state, 0xfe);
-        emit1(&state, 0x07);
-        break;
+/*
+ * Compile and run with the library JIT; the perf and sampling hooks only
+ * need the code address and the per-instruction code offsets.
+ */
+int bf_jit_run(struct bf_program *parsed, unsigned flags) {
+  bf_handle *h = bf_compile_program(parsed, BF_ENGINE_JIT, flags);
+  if (!h)
+    return -1;
+  if (time_phases)
+    bf_phases_append(&phases, bf_handle_phases(h));
+
+  const struct bf_program *prog = bf_handle_program(h);
+  const uint32_t *insn_off;
+  uint32_t code_size;
+  const uint8_t *code = bf_handle_code(h, &code_size, &insn_off);
+
+  // lazily compiled code is only all there once the run is over
+  if ((perf_map || jitdump) && !lazy) {
+    perf_emit(prog, code, insn_off, code_size);
+    phase("perf");
+  }
 
-      case '-':
-        // dec byte [rdi]
-        emit1(&state, 0xfe);
-        emit1(&state, 0x0f);
-        break;
-      
-      case '.':
-        // mov rbx, rdi ;save rdi for write syscall
-        emit1(&state, 0x48);
-        emit1(&state, 0x89);
-        emit1(&state, 0xfb);
-
-        // mov al, byte [rbx] ;arg2 char to write
-        emit1(&state, 0x8a);
-        emit1(&state, 0x03);
-
-        // mov rax, 1 ;syscall number
-        emit1(&state, 0xb8);
-        emit4(&state, 0x01000000);
-
-        // mov rdi, 1 ; arg1 stdout
-        emit1(&state, 0xbf);
-        emit4(&state, 0x01000000);
-
-        // mov rdx, 1; arg3 size
-        emit1(&state, 0xba);
-        emit4(&state, 0x01000000);
-
-        // syscall
-        emit1(&state, 0x0f);
-        emit1(&state, 0x05);
-
-        // mov rdi, rbx
-        emit1(&state, 0x48);
-        emit1(&state, 0x89);
-        emit1(&state, 0xdf);
-        break;
-        
-      case '[':
-        // cmp byte [rdi], 0
-        emit1(&state, 0x80);
-        emit1(&state, 0x3f);
-        emit1(&state, 0x00);
-        open_bracket_off[open_bracket_index++] = state.offset;
-
-        // jz 0
-        emit1(&state, 0x0f);
-        emit1(&state, 0x84);
-        emit4(&state, 0x00000000);
-        break;
+  // the warmup up to a snapshot runs interpreted, there is nothing to time
+  if (save_snapshot) {
+    int rv = bf_snapshot_save(h, save_snapshot, TAP_SIZE,
+                              snapshot_steps ? 0 : BF_STOP_INPUT, snapshot_steps, NULL);
+    fflush(stdout);
+    phase("snapshot");
+    if (time_phases)
+      bf_phases_report(stderr, &phases);
+    bf_free(h);
+    if (rv == BF_ERR_SNAPSHOT)
+      fprintf(stderr, "error: could not write %s\n", save_snapshot);
+    return rv == BF_OK ? 0 : -1;
+  }
 
-      case ']':
-        open_br_off = open_bracket_off[--open_bracket_index];
-        
-        // cmp byte [rdi], 0
-        emit1(&state, 0x80);
-        emit1(&state, 0x3f);
-        emit1(&state, 0x00);
-
-        uint32_t jmp_open_from = state.offset + 6;
-        uint32_t jmp_open_to = open_br_off + 6;
-        uint32_t jmp_open_off = compute_pc_rel32(jmp_open_from, jmp_open_to);
-
-        // jnz jmp_open_off
-        emit1(&state, 0x0f);
-        emit1(&state, 0x85);
-        emit4(&state, jmp_open_off);
-
-        uint32_t jmp_close_from = open_br_off + 6;
-        uint32_t jmp_close_to = state.offset;
-        uint32_t jmp_close_off = compute_pc_rel32(jmp_close_from, jmp_close_to);
-
-        // replace off
-        replace_bytes(state.buf, open_br_off + 2, jmp_close_off, 4);
-        break;
+  size_t tape_size = TAP_SIZE;
+  unsigned char *tape = NULL;
+  bf_snapshot *snap = NULL;
+
+  if (resume) {
+    snap = bf_snapshot_open(h, resume);
+    if (!snap) {
+      fprintf(stderr, "error: %s is not a snapshot of this program\n", resume);
+      bf_free(h);
+      return -1;
     }
   }
+  else {
+    tape = bf_tape_alloc(&tape_size, flags);
+    if (!tape) {
+      fprintf(stderr, "error: could not map tape\n");
+      bf_free(h);
+      return -1;
+    }
+  }
+
+  phase(snap ? "resume" : "tape");
+
+  struct sampler sampler;
+  if (sample && sampler_start(&sampler, code, code_size, insn_off, prog->len) != 0)
+    sample = false;
+
+  if (snap)
+    bf_resume(h, snap, NULL);
+  else
+    bf_run(h, tape, tape_size, NULL);
+  fflush(stdout);
+  phase("run");
+
+  if ((perf_map || jitdump) && lazy) {
+    perf_emit(prog, code, insn_off, code_size);
+    phase("perf");
+  }
+
+  if (sample) {
+    sampler_stop(&sampler);
+    sampler_report(&sampler, prog, stderr);
+    sampler_free(&sampler);
+  }
+
+  if (time_phases)
+    bf_phases_report(stderr, &phases);
+
+  if (tape)
+    bf_tape_free(tape, tape_size);
+  bf_snapshot_close(snap);
+  bf_free(h);
 
-  emit_pop(&state, R15);
-  emit_pop(&state, R14);
-  emit_pop(&state, R13);
-  emit_pop(&state, R12);
-  emit_pop(&state, RBP);
-  emit_pop(&state, RBX);
-
-  void *jitted_code = mmap(NULL, state.offset, PROT_EXEC | PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-  memcpy(jitted_code, state.buf, state.offset);
-  typedef void (*jit_fn)(uint64_t *);
-  jit_fn fn = (jit_fn)jitted_code;
-  uint64_t *tape = (uint64_t *)calloc(TAP_SIZE, sizeof(uint64_t));
-  fn(tape);
+  return 0;
 }
 
 int main(int argc, char *argv[]) {
@@ -266,18 +405,94 @@ int main(int argc, char *argv[]) {
   struct option longopts[] = {
     {.name = "aot", .val = 'a', },
     {.name = "jit", .val = 'j', },
+    {.name = "hugepages", .val = 'H', },
+    {.name = "bytecode", .val = 'b', },
+    {.name = "perf-map", .val = 'P', },
+    {.name = "jitdump", .val = 'D', },
+    {.name = "sample", .val = 'S', },
+    {.name = "save-snapshot", .has_arg = required_argument, .val = 's', },
+    {.name = "snapshot-steps", .has_arg = required_argument, .val = 'n', },
+    {.name = "resume", .has_arg = required_argument, .val = 'r', },
+    {.name = "unroll", .has_arg = required_argument, .val = 'u', },
+    {.name = "lazy", .val = 'L', },
+    {.name = "cell", .has_arg = required_argument, .val = 'c', },
+    {.name = "jobs", .has_arg = required_argument, .val = 'J', },
+    {.name = "time-phases", .val = 'T', },
+    {.name = "dump-ir", .has_arg = required_argument, .val = 'I', },
+    { 0 },
   };
 
   bool aot = false;
+  bool bytecode = false;
 
   int opt;
-  while ((opt = getopt_long(argc, argv, "aj", longopts, NULL)) != -1) {
+  while ((opt = getopt_long(argc, argv, "ajHbPDSs:n:r:u:Lc:J:TI:", longopts, NULL)) != -1) {
     switch(opt) {
       case 'a':
         aot = true;
         break;
       case 'j':
         break;
+      case 'H':
+        hugepages = true;
+        break;
+      case 'b':
+        bytecode = true;
+        break;
+      case 'P':
+        perf_map = true;
+        break;
+      case 'D':
+        jitdump = true;
+        break;
+      case 'S':
+        sample = true;
+        break;
+      case 's':
+        save_snapshot = optarg;
+        break;
+      case 'n':
+        snapshot_steps = strtoull(optarg, NULL, 10);
+        break;
+      case 'r':
+        resume = optarg;
+        break;
+      case 'u':
+        unroll = strtoul(optarg, NULL, 10);
+        if (unroll < 1 || unroll > 128 || (unroll & (unroll - 1))) {
+          printf("Error: --unroll takes a power of two from 1 to 128\n");
+          return 1;
+        }
+        break;
+      case 'L':
+        lazy = true;
+        break;
+      case 'c':
+        cell = strtoul(optarg, NULL, 10);
+        if (cell != 8 && cell != 16 && cell != 32) {
+          printf("Error: --cell takes 8, 16 or 32 (bits)\n");
+          return 1;
+        }
+        cell /= 8;
+        break;
+      case 'J':
+        jobs = strtoul(optarg, NULL, 10);
+        if (jobs < 1 || jobs > 255) {
+          printf("Error: --jobs takes 1 to 255 threads\n");
+          return 1;
+        }
+        break;
+      case 'T':
+        time_phases = true;
+        break;
+      case 'I':
+        dump_ir = optarg;
+        if (strcmp(dump_ir, "parse") && strcmp(dump_ir, "idioms") && strcmp(dump_ir, "loops") &&
+            strcmp(dump_ir, "all")) {
+          printf("Error: --dump-ir takes parse, idioms, loops or all\n");
+          return 1;
+        }
+        break;
       default:
         printf("Unkown option\n");
         return 1;
@@ -289,39 +504,71 @@ int main(int argc, char *argv[]) {
     return 1;
   }
 
-  FILE *ifile = fopen(argv[optind++], "r");
-  if(!ifile) {
+  src_path = argv[optind++];
+
+  // the sampler maps samples through the JIT's code offsets, nothing else has them
+  if (sample && (aot || bytecode)) {
+    printf("Error: --sample only works with --jit\n");
+    return 1;
+  }
+
+  int parse_flags = BF_PARSE_IDIOMS;
+  if (perf_map || jitdump || sample)
+    parse_flags |= BF_PARSE_POSITIONS;
+
+  if (time_phases)
+    bf_phases_start(&phases);
+
+  struct bf_program prog;
+  int rv = bf_load_source(src_path, parse_flags, &prog);
+  if (rv == -1) {
     printf("Error: Could not open file\n");
     return 1;
   }
+  if (rv != 0)
+    return 1;
+  phase("parse");
 
-  if (aot) {
-    if (optind < argc) {
-      ofile = fopen(argv[optind], "w");
-      if(!ofile) {
-        printf("Error: Could not open file\n");
-        return 1;
-      }
-    }
-    else {
-      ofile = stdout;
-    }
+  if (dump_ir) {
+    if (dump_passes(&prog, parse_flags) != 0)
+      return 1;
+    phase("dump-ir");
   }
 
-  fseek(ifile, 0, SEEK_END);
-  long length = ftell(ifile);
-  fseek(ifile, 0, SEEK_SET);
+  if (!aot && !bytecode)
+    return bf_jit_run(&prog, (hugepages ? BF_HUGEPAGES : 0) | (lazy ? BF_LAZY : 0) |
+                      (cell == 2 ? BF_CELL16 : cell == 4 ? BF_CELL32 : 0) |
+                      BF_UNROLL(unroll) | BF_JOBS(jobs) |
+                      (time_phases ? BF_TIME_PHASES : 0)) == 0 ? 0 : 1;
+
+  if (optind < argc) {
+    ofile = fopen(argv[optind], bytecode ? "wb" : "w");
+    if(!ofile) {
+      printf("Error: Could not open file\n");
+      return 1;
+    }
+  }
+  else {
+    ofile = stdout;
+  }
 
-  unsigned char *code = (unsigned char *)malloc(length + 1);
-  int rv = fread(code, 1, length, ifile);
-  if (rv != length)
+  if (bytecode) {
+    if (bf_write_bytecode(ofile, &prog, BF_PARSE_IDIOMS) != 0) {
+      printf("Error: Could not write bytecode\n");
+      return 1;
+    }
+    phase("write");
+  }
+  else if (bf_aot_comp(&prog, unroll, ofile) != 0) {
+    printf("Error: Could not write assembly\n");
     return 1;
-  code[length] = '\0';
-  fclose(ifile);
+  }
+  if (ofile != stdout)
+    fclose(ofile);
 
-  (void)ofile;
-  // bf_aot_comp(code, ofile);
-  bf_jit_com_x86_64(code, length);
+  bf_program_free(&prog);
+  if (time_phases)
+    bf_phases_report(stderr, &phases);
   
   return 0;
 }
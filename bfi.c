@@ -3,20 +3,12 @@
 #include <getopt.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include "brainfused.h"
+#include "bf_insn.h"
 
 #define TAP_SIZE 1048576
 #define MAX_LOOPS 1024
 
-#define HALT 0
-#define BF_RIGHT 1
-#define BF_LEFT 2
-#define BF_INC 3
-#define BF_DEC 4
-#define BF_OUT 5
-#define BF_IN 6
-#define BF_OPEN 7
-#define BF_CLOSE 8
-
 struct pstats {
   uint64_t right;
   uint64_t left;
@@ -32,9 +24,6 @@ struct loop_info {
   int count;
 };
 
-static bool profile = false;
-static struct pstats *stats;
-
 int compare(const void *a, const void *b) {
   struct loop_info *l1 = (struct loop_info *)a;
   struct loop_info *l2 = (struct loop_info *)b;
@@ -51,7 +40,7 @@ int get_info_index(struct loop_info linfo[], int total_loops, int start) {
   return -1;
 }
 
-bool is_simple_loop(unsigned char *program, struct loop_info *linfo) {
+bool is_simple_loop(struct bf_insn *program, struct loop_info *linfo) {
   int start = linfo->start;
   int end = linfo->end;
   int pointer_movement = 0;
@@ -59,13 +48,13 @@ bool is_simple_loop(unsigned char *program, struct loop_info *linfo) {
   bool has_io = false;
 
   for (int i = start + 1; i < end; i++) {
-    switch (program[i]) {
-      case '>': pointer_movement++; break;
-      case '<': pointer_movement--; break;
-      case '+': if (pointer_movement == 0) p0_change++; break;
-      case '-': if (pointer_movement == 0) p0_change--; break;
-      case '.':
-      case ',': has_io = true; break;
+    switch (program[i].op) {
+      case BF_RIGHT: pointer_movement += program[i].arg; break;
+      case BF_LEFT: pointer_movement -= program[i].arg; break;
+      case BF_INC: if (pointer_movement == 0) p0_change += program[i].arg; break;
+      case BF_DEC: if (pointer_movement == 0) p0_change -= program[i].arg; break;
+      case BF_OUT:
+      case BF_IN: has_io = true; break;
     }
   }
 
@@ -76,333 +65,47 @@ bool is_simple_loop(unsigned char *program, struct loop_info *linfo) {
   return false;
 }
 
-void print_loop(unsigned char *program, struct loop_info *linfo) {
-  for (int i = linfo->start; i <= linfo->end; i++) {
-    if (program[i] == '>' || program[i] == '<'
-        || program[i] == '+' || program[i] == '-'
-        || program[i] == '.' || program[i] == ','
-        || program[i] == '[' || program[i] == ']') {
-      
-      printf("%c", program[i]);
-    }
-  }
-
+void print_loop(struct bf_insn *program, struct loop_info *linfo) {
+  bf_print_insns(stdout, program, linfo->start, linfo->end, 0);
   printf(" => %d\n", linfo->count);
 }
 
-int bf_interp(unsigned char *program) {
-  char *tape = (char *)calloc(TAP_SIZE, 1);
-  char *ptr = tape;
-  unsigned char *code = program;
-  struct loop_info loops[MAX_LOOPS];
-  struct loop_info simple_loops[MAX_LOOPS];
-  struct loop_info not_simple_loops[MAX_LOOPS];
-  int loop_index;
-  int loop_start = 0;
-  int loop_end = 0;
-  int loop_stack = 0;
-  int total_loops = 0;
-  int total_simple_loops = 0;
-  int total_not_simple_loops = 0;
-  bool is_inner = false;
-
-  while(*code) {
-    switch(*code) {
-      case '>':
-        if ((ptr + 1) > (tape + TAP_SIZE)) {
-            fprintf(stderr, "error: tap overflow\n");
-            return -1;
-        }
-
-        if (profile)
-          stats->right++;
-
-        ptr++;
-        break;
-      
-      case '<':
-        if ((ptr - 1) < tape) {
-            fprintf(stderr, "error: tap underflow\n");
-            return -1;
-        }
-        
-        if (profile)
-          stats->left++;
-        
-        ptr--;
-        break;
-      
-      case '+':
-        if (profile)
-          stats->inc++;
-        
-        (*ptr)++;
-        break;
-      
-      case '-':
-        if (profile)
-          stats->dec++;
-        
-        (*ptr)--;
-        break;
-      
-      case '.':
-        if (profile)
-          stats->out++;
-
-        putchar(*ptr);
-        break;
-      
-      case ',':
-        if (profile)
-          stats->in++;
-        
-        *ptr = getchar();
-        getchar();
-        break;
-      
-      case '[':
-        // skip the loop
-        if(!*ptr) {
-          int loop = 1;
-          while(loop) {
-            code++;
-            if(*code == '[') loop++;
-            if(*code == ']') loop--;
-          }
-        }
-        else {
-          if (profile) {
-            loop_stack++;
-            is_inner = false;
-            loop_start = code - program;
-          }
-        }
-        break;
-      
-      case ']':
-        if (profile) {
-          loop_stack--;
-
-          if (loop_stack == 0) {
-            loop_end = (int)(code - program);
-            loop_index = get_info_index(loops, total_loops, loop_start);
-            if (loop_index != -1) {
-              loops[loop_index].count++;
-            }
-            else {
-              loops[total_loops].start = loop_start;
-              loops[total_loops].end = loop_end;
-              loops[total_loops++].count = 1;
-            }
-
-            // printf("simple loop: [%d, %d]\n", loop_start, loop_end);
-          }
-          else {
-            if (!is_inner) {
-              // inner loop
-              loop_end = (int)(code - program);
-              loop_index = get_info_index(loops, total_loops, loop_start);
-              if (loop_index != -1) {
-                loops[loop_index].count++;
-              }
-              else {
-                loops[total_loops].start = loop_start;
-                loops[total_loops].end = loop_end;
-                loops[total_loops++].count = 1;
-              }
-              // printf("simple loop: [%d, %d]\n", loop_start, loop_end);
-              is_inner = true;
-            }
-          }
-        }
-
-        // jump to matching [
-        if(*ptr) {
-          int loop = 1;
-          while(loop) {
-            code--;
-            if(*code == '[') loop--;
-            if(*code == ']') loop++;
-          }
-        }
-        break;
-
-      default:
-        break;
-    }
-
-    code++;
-  }
-
-  // print statistics
-  if (profile) {
-    printf("\n\n ====== PROFILE ======\n\n");
-    printf("> => %lu\n", stats->right);
-    printf("< => %lu\n", stats->left);
-    printf("+ => %lu\n", stats->inc);
-    printf("- => %lu\n", stats->dec);
-    printf(", => %lu\n", stats->in);
-    printf(". => %lu\n\n", stats->out);
-    for (int i = 0; i < total_loops; i++) {
-      if (is_simple_loop(program, &loops[i]))
-        simple_loops[total_simple_loops++] = loops[i];
-      else
-        not_simple_loops[total_not_simple_loops++] = loops[i];
-    }
-
-    qsort(simple_loops, total_simple_loops, sizeof(struct loop_info), compare);
-    qsort(not_simple_loops, total_not_simple_loops, sizeof(struct loop_info), compare);
-
-    // print loops
-    printf("Simple inner loops:\n");
-    for (int i = 0; i < total_simple_loops; i++) {
-      print_loop(program, &simple_loops[i]);
-    }
-    
-    printf("\nOther inner loops:\n");
-    for (int i = 0; i < total_not_simple_loops; i++) {
-      print_loop(program, &not_simple_loops[i]);
-    }
-  }
-
-  return 0;
-}
-
-unsigned char char_to_cmd(char c) {
-  switch(c) {
-    case '>':
-      return BF_RIGHT;
-    case '<':
-      return BF_LEFT;
-    case '+':
-      return BF_INC;
-    case '-':
-      return BF_DEC;
-    case '.':
-      return BF_OUT;
-    case ',':
-      return BF_IN;
-    case '[':
-      return BF_OPEN;
-    case ']':
-      return BF_CLOSE;
-    case '\0':
-      return '\0';
-    default:
-      return 255;
-  }
-}
-
-unsigned char *translate(unsigned char *code, int len) {
-  unsigned char *buf = (unsigned char *)malloc(len);
-  int buf_len = 0;
-  while(*code) {
-    unsigned char ch = char_to_cmd(*code);
-    if (ch != 255) {
-      buf[buf_len++] = ch;
-    }
-    code++;
-  }
-  
-  return buf;
-}
-
-int interp_cgoto(unsigned char *code_org, int len) {
-  char *tape = (char *)calloc(TAP_SIZE, 1);
-  char *ptr = tape;
-  unsigned char *code;
-
-  code = translate(code_org, len);
-
-  static void *cmds[] = {
-    &&halt, &&right, &&left, &&inc, &&dec, &&out, &&in, &&open, &&close
-  };
-    
-  goto *cmds[*code];
-
-  while(1) {
-    right:
-      if ((ptr + 1) > (tape + TAP_SIZE)) {
-          fprintf(stderr, "error: tap overflow\n");
-          return -1;
-      }
-      ptr++;
-      code++;
-      goto *cmds[*code];
-
-    left:
-      if ((ptr - 1) < tape) {
-          fprintf(stderr, "error: tap underflow\n");
-          return -1;
-      }
-      ptr--;
-      code++;
-      goto *cmds[*code];
-
-    inc:
-      (*ptr)++;
-      code++;
-      goto *cmds[*code];
-
-    dec:
-      (*ptr)--;
-      code++;
-      goto *cmds[*code];
-
-    out:
-      putchar(*ptr);
-      code++;
-      goto *cmds[*code];
-
-    in:
-      *ptr = getchar();
-      code++;
-      goto *cmds[*code];
-
-    open:
-      if(!*ptr) {
-        int loop = 1;
-        while(loop) {
-          code++;
-          if(*code == BF_OPEN) loop++;
-          if(*code == BF_CLOSE) loop--;
-        }
-      }
-      code++;
-      goto *cmds[*code];
-
-    close:
-      if(*ptr) {
-        int loop = 1;
-        while(loop) {
-          code--;
-          if(*code == BF_OPEN) loop--;
-          if(*code == BF_CLOSE) loop++;
-        }
-      }
-      code++;
-      goto *cmds[*code];
-    
-    halt:
-      break;
-  }
-
-  return 0;
-}
+#define CELL uint8_t
+#define CELL_FN(name) name##_8
+#include "bfi_interp.h"
+#define CELL uint16_t
+#define CELL_FN(name) name##_16
+#include "bfi_interp.h"
+#define CELL uint32_t
+#define CELL_FN(name) name##_32
+#include "bfi_interp.h"
 
 int main(int argc, char *argv[]) {
   struct option longopts[] = {
     { .name = "interp", .val = 'i', },
     { .name = "cgoto", .val = 'g', },
+    { .name = "trace", .val = 't', },
     { .name = "profile", .val = 'p', },
+    { .name = "sample", .val = 'S', },
+    { .name = "save-snapshot", .has_arg = required_argument, .val = 's', },
+    { .name = "snapshot-steps", .has_arg = required_argument, .val = 'n', },
+    { .name = "resume", .has_arg = required_argument, .val = 'r', },
+    { .name = "cell", .has_arg = required_argument, .val = 'c', },
+    { 0 },
   };
 
   bool cgoto = false;
   bool interp = false;
+  bool trace = false;
+  bool profile = false;
+  bool sample = false;
+  const char *save_snapshot = NULL;
+  const char *resume = NULL;
+  uint64_t snapshot_steps = 0;
+  unsigned cell = 8;
 
   int opt;
-  while ((opt = getopt_long(argc, argv, "igp", longopts, NULL)) != -1) {
+  while ((opt = getopt_long(argc, argv, "igtpSs:n:r:c:", longopts, NULL)) != -1) {
     switch(opt) {
       case 'i':
         interp = true;
@@ -410,40 +113,129 @@ int main(int argc, char *argv[]) {
       case 'g':
         cgoto = true;
         break;
+      case 't':
+        trace = true;
+        break;
       case 'p':
         profile = true;
         break;
+      case 'S':
+        sample = true;
+        break;
+      case 's':
+        save_snapshot = optarg;
+        break;
+      case 'n':
+        snapshot_steps = strtoull(optarg, NULL, 10);
+        break;
+      case 'r':
+        resume = optarg;
+        break;
+      case 'c':
+        cell = strtoul(optarg, NULL, 10);
+        if (cell != 8 && cell != 16 && cell != 32) {
+          printf("Error: --cell takes 8, 16 or 32 (bits)\n");
+          return 1;
+        }
+        break;
       default:
         printf("Unkown option\n");
         return 1;
     }
   }
 
-  stats = (struct pstats *)calloc(1, sizeof(struct pstats));
+  if (optind >= argc) {
+    printf("Error: No input file\n");
+    return 1;
+  }
 
-  FILE *file = fopen(argv[optind], "r");
-  if(!file) {
-    printf("Error: Could not open file\n");
+  // the switch interpreter always runs a program from its start
+  if (interp && (save_snapshot || resume)) {
+    printf("Error: --save-snapshot and --resume need --cgoto or --trace\n");
     return 1;
   }
 
-  fseek(file, 0, SEEK_END);
-  long length = ftell(file);
-  fseek(file, 0, SEEK_SET);
+  // samples are mapped back to the source through the JIT's code offsets;
+  // trace code (--trace) has no such map yet
+  if (sample) {
+    printf("Error: --sample only works with bfc --jit\n");
+    return 1;
+  }
 
-  unsigned char *code = (unsigned char *)malloc(length + 1);
-  int rv = fread(code, 1, length, file);
-  if (rv != length)
+  // precompiled bytecode from bfc --bytecode runs as is
+  struct bf_program prog;
+  int rv = bf_load_bytecode(argv[optind], &prog);
+  if (rv == -3) {
+    printf("Error: Corrupt or incompatible bytecode file\n");
     return 1;
-  code[length] = '\0';
-  fclose(file);
+  }
+
+  // the profiler reports loops as written, keep [-] as a loop there
+  if (rv == -2)
+    rv = bf_load_source(argv[optind], profile ? 0 : BF_PARSE_IDIOMS, &prog);
+  if (rv == -1) {
+    printf("Error: Could not open file\n");
+    return 1;
+  }
+  if (rv != 0)
+    return 1;
+
+  if (interp) {
+    struct pstats stats = { 0 };
 
-  if (interp)
-    bf_interp(code);
-  else if (cgoto)
-    interp_cgoto(code, length);
+    if (cell == 32)
+      bf_interp_32(prog.code, profile ? &stats : NULL);
+    else if (cell == 16)
+      bf_interp_16(prog.code, profile ? &stats : NULL);
+    else
+      bf_interp_8(prog.code, profile ? &stats : NULL);
+    bf_program_free(&prog);
+  }
+  else if (cgoto || trace) {
+    unsigned flags = cell == 32 ? BF_CELL32 : cell == 16 ? BF_CELL16 : 0;
+    bf_handle *h = bf_compile_program(&prog, trace ? BF_ENGINE_TRACE : BF_ENGINE_INTERP, flags);
+    size_t tape_size = TAP_SIZE;
+    unsigned char *tape = NULL;
+    bf_snapshot *snap = NULL;
+
+    if (save_snapshot) {
+      // without a step count, the warmup ends at the first ','
+      rv = bf_snapshot_save(h, save_snapshot, tape_size,
+                            snapshot_steps ? 0 : BF_STOP_INPUT, snapshot_steps, NULL);
+      if (rv == BF_ERR_SNAPSHOT)
+        fprintf(stderr, "error: could not write %s\n", save_snapshot);
+    }
+    else if (resume) {
+      snap = bf_snapshot_open(h, resume);
+      if (!snap) {
+        printf("Error: %s is not a snapshot of this program\n", resume);
+        bf_free(h);
+        return 1;
+      }
+      rv = bf_resume(h, snap, NULL);
+    }
+    else {
+      tape = bf_tape_alloc(&tape_size, 0);
+      rv = bf_run(h, tape, tape_size, NULL);
+    }
+
+    switch (rv) {
+      case BF_ERR_TAPE_OVERFLOW:
+        fprintf(stderr, "error: tap overflow\n");
+        break;
+      case BF_ERR_TAPE_UNDERFLOW:
+        fprintf(stderr, "error: tap underflow\n");
+        break;
+    }
+
+    if (tape)
+      bf_tape_free(tape, tape_size);
+    bf_snapshot_close(snap);
+    bf_free(h);
+  }
   else {
     printf("Please specify an interpreter\n");
+    bf_program_free(&prog);
     return 1;
   }
   
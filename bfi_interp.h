@@ -0,0 +1,190 @@
+/*
+ * bfi's switch interpreter, instantiated once per cell width: include
+ * with CELL defined as the cell type and CELL_FN(name) as the name of
+ * the function for that width. No include guard on purpose.
+ */
+
+#if !defined(CELL) || !defined(CELL_FN)
+#error "define CELL and CELL_FN before including bfi_interp.h"
+#endif
+
+/* Switch interpreter, profiles the run into stats unless it is NULL */
+static int CELL_FN(bf_interp)(struct bf_insn *program, struct pstats *stats) {
+  CELL *tape = (CELL *)calloc(TAP_SIZE / sizeof(CELL), sizeof(CELL));
+  CELL *ptr = tape;
+  struct bf_insn *code = program;
+  struct loop_info loops[MAX_LOOPS];
+  struct loop_info simple_loops[MAX_LOOPS];
+  struct loop_info not_simple_loops[MAX_LOOPS];
+  int loop_index;
+  int loop_start = 0;
+  int loop_end = 0;
+  int loop_stack = 0;
+  int total_loops = 0;
+  int total_simple_loops = 0;
+  int total_not_simple_loops = 0;
+  bool is_inner = false;
+
+  while(code->op != HALT) {
+    switch(code->op) {
+      case BF_RIGHT:
+        if ((ptr + code->arg) >= (tape + TAP_SIZE / sizeof(CELL))) {
+            fprintf(stderr, "error: tap overflow\n");
+            free(tape);
+            return -1;
+        }
+
+        if (stats)
+          stats->right += code->arg;
+
+        ptr += code->arg;
+        break;
+      
+      case BF_LEFT:
+        if ((ptr - code->arg) < tape) {
+            fprintf(stderr, "error: tap underflow\n");
+            free(tape);
+            return -1;
+        }
+        
+        if (stats)
+          stats->left += code->arg;
+        
+        ptr -= code->arg;
+        break;
+      
+      case BF_INC:
+        if (stats)
+          stats->inc += code->arg;
+        
+        *ptr += code->arg;
+        break;
+      
+      case BF_DEC:
+        if (stats)
+          stats->dec += code->arg;
+        
+        *ptr -= code->arg;
+        break;
+      
+      case BF_CLEAR:
+        *ptr = 0;
+        break;
+
+      case BF_OUT:
+        if (stats)
+          stats->out++;
+
+        putchar(*ptr);
+        break;
+      
+      case BF_IN:
+        if (stats)
+          stats->in++;
+        
+        *ptr = getchar();
+        getchar();
+        break;
+      
+      case BF_OPEN:
+        // skip the loop
+        if(!*ptr) {
+          code += code->arg;
+          continue;
+        }
+        else {
+          if (stats) {
+            loop_stack++;
+            is_inner = false;
+            loop_start = code - program;
+          }
+        }
+        break;
+      
+      case BF_CLOSE:
+        if (stats) {
+          loop_stack--;
+
+          if (loop_stack == 0) {
+            loop_end = (int)(code - program);
+            loop_index = get_info_index(loops, total_loops, loop_start);
+            if (loop_index != -1) {
+              loops[loop_index].count++;
+            }
+            else {
+              loops[total_loops].start = loop_start;
+              loops[total_loops].end = loop_end;
+              loops[total_loops++].count = 1;
+            }
+
+            // printf("simple loop: [%d, %d]\n", loop_start, loop_end);
+          }
+          else {
+            if (!is_inner) {
+              // inner loop
+              loop_end = (int)(code - program);
+              loop_index = get_info_index(loops, total_loops, loop_start);
+              if (loop_index != -1) {
+                loops[loop_index].count++;
+              }
+              else {
+                loops[total_loops].start = loop_start;
+                loops[total_loops].end = loop_end;
+                loops[total_loops++].count = 1;
+              }
+              // printf("simple loop: [%d, %d]\n", loop_start, loop_end);
+              is_inner = true;
+            }
+          }
+        }
+
+        // jump back into the loop body
+        if(*ptr) {
+          code += code->arg;
+          continue;
+        }
+        break;
+
+      default:
+        break;
+    }
+
+    code++;
+  }
+
+  // print statistics
+  if (stats) {
+    printf("\n\n ====== PROFILE ======\n\n");
+    printf("> => %lu\n", stats->right);
+    printf("< => %lu\n", stats->left);
+    printf("+ => %lu\n", stats->inc);
+    printf("- => %lu\n", stats->dec);
+    printf(", => %lu\n", stats->in);
+    printf(". => %lu\n\n", stats->out);
+    for (int i = 0; i < total_loops; i++) {
+      if (is_simple_loop(program, &loops[i]))
+        simple_loops[total_simple_loops++] = loops[i];
+      else
+        not_simple_loops[total_not_simple_loops++] = loops[i];
+    }
+
+    qsort(simple_loops, total_simple_loops, sizeof(struct loop_info), compare);
+    qsort(not_simple_loops, total_not_simple_loops, sizeof(struct loop_info), compare);
+
+    // print loops
+    printf("Simple inner loops:\n");
+    for (int i = 0; i < total_simple_loops; i++) {
+      print_loop(program, &simple_loops[i]);
+    }
+    
+    printf("\nOther inner loops:\n");
+    for (int i = 0; i < total_not_simple_loops; i++) {
+      print_loop(program, &not_simple_loops[i]);
+    }
+  }
+
+  return 0;
+}
+
+#undef CELL
+#undef CELL_FN
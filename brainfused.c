@@ -0,0 +1,1401 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "brainfused.h"
+#include "bf_insn.h"
+#include "bf_jit_x86_64.h"
+#include "bf_trace.h"
+#include "bf_loops.h"
+#include "bf_parallel.h"
+#include "bf_phases.h"
+
+#define HUGE_PAGE_SIZE (2UL * 1024 * 1024)
+
+/* offsets into struct bf_io, used by the generated code */
+#define IO_READ 0
+#define IO_WRITE 8
+#define IO_CTX 16
+
+/* snapshot file: header, padded to a page, then the tape */
+#define BF_SNAP_MAGIC "BFSS"
+#define BF_SNAP_VERSION 2
+#define BF_SNAP_TAPE_OFFSET 4096
+
+struct bf_snap_header {
+  char magic[4];
+  uint32_t version;
+  uint64_t program_checksum;
+  uint64_t tape_size;
+  uint64_t ptr;
+  uint64_t steps;
+  uint32_t pc;
+  uint32_t cell;    /* cell width in bytes */
+};
+
+struct bf_snapshot {
+  void *map;
+  size_t map_size;
+  unsigned char *tape;
+  size_t tape_size;
+  size_t ptr;
+  uint32_t pc;
+};
+
+struct jit_loop {
+  bool short_open;
+  bool short_close;
+  bool counted;
+  bool split;      /* lazy JIT: body compiled as chunks of its own */
+  int64_t trips;   /* BF_TRIP_UNKNOWN or known on entry */
+};
+
+
+struct bf_handle {
+  int engine;
+  unsigned flags;
+  unsigned cell;        /* cell width in bytes */
+  struct bf_program prog;
+  uint64_t checksum;
+
+  /* interpreter only, prog.code rewritten to handler addresses */
+  struct bf_insn *threaded;
+
+  /* JIT only */
+  uint8_t *code;
+  size_t code_map_size;
+  uint32_t code_size;
+  uint32_t *insn_off;
+
+  /* BF_LAZY only, code is filled in as the runs get to it */
+  struct jit_lazy *lazy;
+
+  /* BF_TIME_PHASES only */
+  struct bf_phases phases;
+};
+
+static void phase_end(struct bf_handle *h, const char *name) {
+  if (h->flags & BF_TIME_PHASES)
+    bf_phase_end(&h->phases, name);
+}
+
+typedef unsigned char *(*jit_fn)(unsigned char *ptr, const struct bf_io *io,
+                                  const uint8_t *entry);
+
+static int stdio_read(void *ctx) {
+  (void)ctx;
+  return getchar();
+}
+
+static void stdio_write(void *ctx, int c) {
+  (void)ctx;
+  putchar(c);
+}
+
+static int buffers_read(void *ctx) {
+  struct bf_buffers *bufs = (struct bf_buffers *)ctx;
+
+  if (bufs->in_pos >= bufs->in_size)
+    return -1;
+  return bufs->in[bufs->in_pos++];
+}
+
+static void buffers_write(void *ctx, int c) {
+  struct bf_buffers *bufs = (struct bf_buffers *)ctx;
+
+  if (bufs->out_len < bufs->out_size)
+    bufs->out[bufs->out_len++] = c;
+}
+
+static const struct bf_io stdio_io = { stdio_read, stdio_write, NULL };
+
+void bf_io_stdio(struct bf_io *io) {
+  *io = stdio_io;
+}
+
+void bf_io_buffers(struct bf_io *io, struct bf_buffers *bufs) {
+  io->read = buffers_read;
+  io->write = buffers_write;
+  io->ctx = bufs;
+}
+
+/*
+ * Anonymous read/write mapping of at least *size bytes, *size is updated
+ * to the mapped length. With huge set, explicit 2 MiB pages are tried
+ * first, then a 2 MiB aligned region advised for transparent huge pages.
+ */
+static void *map_region(size_t *size, bool huge) {
+  void *p;
+
+  if (!huge) {
+    p = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return p == MAP_FAILED ? NULL : p;
+  }
+  size_t hsize = (*size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+
+  p = mmap(NULL, hsize, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (p != MAP_FAILED) {
+    *size = hsize;
+    return p;
+  }
+
+  // no hugetlbfs pages reserved, align by hand and ask for THP
+  size_t map_size = hsize + HUGE_PAGE_SIZE;
+  uint8_t *raw = (uint8_t *)mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (raw == MAP_FAILED)
+    return NULL;
+
+  uint8_t *aligned = (uint8_t *)(((uintptr_t)raw + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1));
+  if (aligned > raw)
+    munmap(raw, aligned - raw);
+  if (raw + map_size > aligned + hsize)
+    munmap(aligned + hsize, (raw + map_size) - (aligned + hsize));
+
+  madvise(aligned, hsize, MADV_HUGEPAGE);
+  *size = hsize;
+
+  return aligned;
+}
+
+static uint32_t compute_pc_rel32(uint32_t from, uint32_t to) {
+  if (to >= from)
+    return to - from;
+  else
+    return ~(from - to) + 1;
+}
+
+static void replace_bytes(uint8_t *buf, uint32_t offset, uint32_t value, int size) {
+  for (int i = 0; i < size; i++) {
+    buf[offset + i] = (value >> (i * 8)) & 0xff;
+  }
+}
+
+/*
+ * The cell pointer lives in rbx and the struct bf_io pointer in r12, both
+ * callee saved so they survive the I/O callbacks. Cells are state->cell
+ * bytes wide.
+ */
+static void jit_emit_insn(struct jit_state *state, struct bf_insn *insn) {
+  uint32_t imm = insn->arg & bf_cell_mask(state->cell);
+  intptr_t move = insn->arg * state->cell;
+
+  switch(insn->op) {
+    case BF_RIGHT:
+      // inc rbx / add rbx, imm
+      emit1(state, 0x48);
+      if (move == 1) {
+        emit1(state, 0xff);
+        emit1(state, 0xc3);
+      }
+      else if (move <= 127) {
+        emit1(state, 0x83);
+        emit1(state, 0xc3);
+        emit1(state, move);
+      }
+      else {
+        emit1(state, 0x81);
+        emit1(state, 0xc3);
+        emit4(state, move);
+      }
+      break;
+
+    case BF_LEFT:
+      // dec rbx / sub rbx, imm
+      emit1(state, 0x48);
+      if (move == 1) {
+        emit1(state, 0xff);
+        emit1(state, 0xcb);
+      }
+      else if (move <= 127) {
+        emit1(state, 0x83);
+        emit1(state, 0xeb);
+        emit1(state, move);
+      }
+      else {
+        emit1(state, 0x81);
+        emit1(state, 0xeb);
+        emit4(state, move);
+      }
+      break;
+
+    case BF_INC:
+      // inc [rbx] / add [rbx], imm
+      if (imm == 1)
+        emit_cell_incdec(state, 0, RBX, 0);
+      else if (imm)
+        emit_cell_alu(state, 0, RBX, 0, imm);
+      break;
+
+    case BF_DEC:
+      // dec [rbx] / sub [rbx], imm
+      if (imm == 1)
+        emit_cell_incdec(state, 1, RBX, 0);
+      else if (imm)
+        emit_cell_alu(state, 5, RBX, 0, imm);
+      break;
+
+    case BF_CLEAR:
+      // mov [rbx], 0
+      emit_cell_mov(state, RBX, 0, 0);
+      break;
+    
+    case BF_OUT:
+      // mov rdi, [r12 + IO_CTX]
+      emit1(state, 0x49);
+      emit1(state, 0x8b);
+      emit1(state, 0x7c);
+      emit1(state, 0x24);
+      emit1(state, IO_CTX);
+
+      // movzx esi, byte/word [rbx] / mov esi, [rbx]
+      if (state->cell == 4) {
+        emit1(state, 0x8b);
+      }
+      else {
+        emit1(state, 0x0f);
+        emit1(state, state->cell == 1 ? 0xb6 : 0xb7);
+      }
+      emit1(state, 0x33);
+
+      // call [r12 + IO_WRITE]
+      emit1(state, 0x41);
+      emit1(state, 0xff);
+      emit1(state, 0x54);
+      emit1(state, 0x24);
+      emit1(state, IO_WRITE);
+      break;
+
+    case BF_IN:
+      // mov rdi, [r12 + IO_CTX]
+      emit1(state, 0x49);
+      emit1(state, 0x8b);
+      emit1(state, 0x7c);
+      emit1(state, 0x24);
+      emit1(state, IO_CTX);
+
+      // call [r12 + IO_READ]
+      emit1(state, 0x41);
+      emit1(state, 0xff);
+      emit1(state, 0x14);
+      emit1(state, 0x24);
+
+      // mov [rbx], al/ax/eax
+      emit_cell_opcode(state, 0x88);
+      emit1(state, 0x03);
+      break;
+  }
+}
+
+/* cmp [rbx], 0, the test of every bracket */
+static void jit_emit_test(struct jit_state *state) {
+  emit_cell_alu(state, 7, RBX, 0, 0);
+}
+
+/*
+ * k iterations of a counted loop folded into one straight-line block:
+ * add [rbx+off], k*delta / mov [rbx+off], value
+ */
+static void jit_emit_cells(struct jit_state *state, struct bf_cell_effect *cells, uint32_t n,
+                           uint32_t k) {
+  // no iterations change no cell, set ones included
+  if (k == 0)
+    return;
+
+  for (uint32_t c = 0; c < n; c++) {
+    uint32_t value = cells[c].set ? cells[c].value : cells[c].value * k;
+    intptr_t off = cells[c].off * state->cell;
+
+    value &= bf_cell_mask(state->cell);
+    if (cells[c].set)
+      emit_cell_mov(state, RBX, off, value);
+    else if (value)
+      emit_cell_alu(state, 0, RBX, off, value);
+  }
+}
+
+static void jit_emit_jump(struct jit_state *state, uint8_t opcode, uint32_t to) {
+  if (opcode == 0xe9) {
+    emit1(state, 0xe9);
+  }
+  else {
+    emit1(state, 0x0f);
+    emit1(state, opcode);
+  }
+  emit4(state, compute_pc_rel32(state->offset + 4, to));
+}
+
+/*
+ * Counted loops (see bf_loops.h). With the trip count known at compile
+ * time the whole loop is one folded block. Otherwise it is unrolled by
+ * factor, a power of two: the counter says how many iterations are left
+ * and its low bits are the same whether it counts down or up towards
+ * the wrap, so single iterations run until it is a multiple of factor and
+ * then whole groups of factor iterations, folded into one block, with
+ * one bottom test per group:
+ *
+ *              test [rbx], factor-1 ; jz group_test
+ *   rem:       <1 iteration>
+ *              test [rbx], factor-1 ; jnz rem
+ *   group_test: cmp [rbx], 0 ; jz end
+ *   group:     <factor iterations>
+ *              cmp [rbx], 0 ; jnz group
+ *
+ * The instructions inside the loop get no code of their own and share
+ * the code offset of the '['; a snapshot resumed in there is run out of
+ * the loop by the interpreter first (see jit_leave_folded).
+ */
+static void jit_emit_counted(struct jit_state *state, struct bf_program *prog, uint32_t open,
+                             struct bf_cell_effect *cells, uint32_t n, int64_t trips,
+                             uint32_t factor, uint32_t *insn_off) {
+  uint32_t close = open + prog->code[open].arg - 1;
+  uint32_t start = state->offset;
+
+  if (insn_off) {
+    for (uint32_t i = open + 1; i <= close; i++)
+      insn_off[i] = start;
+  }
+
+  if (trips != BF_TRIP_UNKNOWN) {
+    // a loop that never runs leaves every cell as it is
+    if (trips > 0)
+      jit_emit_cells(state, cells, n, trips);
+  }
+  else {
+    uint32_t jz_group_test, jz_end, rem, group;
+
+    // test [rbx], factor - 1
+    emit_cell_test(state, RBX, 0, factor - 1);
+    jz_group_test = state->offset;
+    jit_emit_jump(state, 0x84, 0);
+
+    rem = state->offset;
+    jit_emit_cells(state, cells, n, 1);
+    emit_cell_test(state, RBX, 0, factor - 1);
+    jit_emit_jump(state, 0x85, rem);
+
+    replace_bytes(state->buf, jz_group_test + 2,
+                  compute_pc_rel32(jz_group_test + 6, state->offset), 4);
+
+    jit_emit_test(state);
+    jz_end = state->offset;
+    jit_emit_jump(state, 0x84, 0);
+
+    group = state->offset;
+    jit_emit_cells(state, cells, n, factor);
+    jit_emit_test(state);
+    jit_emit_jump(state, 0x85, group);
+
+    replace_bytes(state->buf, jz_end + 2, compute_pc_rel32(jz_end + 6, state->offset), 4);
+  }
+}
+
+/*
+ * Lazy JIT (BF_LAZY). The program is cut into chunks which are compiled
+ * the first time they are entered: the body of every top-level loop, and
+ * of any loop too big for one chunk, is a chunk of its own and
+ * straight-line code is cut every LAZY_CHUNK instructions, so no single
+ * compile takes longer than LAZY_CHUNK instructions' worth, however big
+ * the program. Top-level loops under LAZY_MIN_SPLIT instructions stay in
+ * the surrounding chunk, compiling them costs less than the trip through
+ * the compiler that would save it.
+ *
+ * Code memory is reserved up front: the prologue, a table of stubs, one
+ * per chunk, then an upper bound of code per chunk in program order, so
+ * insn_off stays sorted for perf and the sampler, and the halt. Every
+ * jump into a chunk goes through its stub, whose jmp first leads to the
+ * trampoline behind it, which returns to lazy_run with the chunk to
+ * compile, and once compiled to the chunk's code. Only that aligned
+ * rel32 is ever rewritten, with a single store, so runs on other threads
+ * see one target or the other.
+ *
+ *   stub:  nop3 ; jmp rel32            -> trampoline, then code
+ *          mov edx, chunk + 1 ; jmp exit
+ *   code:  ... ; jmp stub of the next chunk
+ *   halt:  xor edx, edx
+ *   exit:  epilogue
+ *
+ * The memory is a memfd mapped twice, read/write for the compiler and
+ * read/execute for the runs: never writable and executable at once, and
+ * running code does not have to stop while a chunk is added. Pages are
+ * only backed once code is written to them.
+ */
+#define LAZY_CHUNK 512
+#define LAZY_MIN_SPLIT 32
+#define LAZY_INSN_BYTES 64    /* most code one instruction compiles to */
+#define LAZY_STUBS 64         /* stub table offset, after the prologue */
+#define LAZY_STUB_SIZE 24
+#define LAZY_STUB_JMP 3
+#define LAZY_STUB_TRAMPOLINE 8
+#define LAZY_HALT_SIZE 32
+
+struct jit_lazy {
+  pthread_mutex_t lock;
+  uint8_t *rw;              /* writable view of h->code */
+  struct jit_loop *loops;
+  int64_t *trips;
+  uint32_t cell;
+  uint32_t factor;
+  uint32_t nchunks;
+  uint32_t *start;          /* first instruction of each chunk, start[nchunks] = len */
+  uint32_t *slot;           /* code offset of each chunk, slot[nchunks] is the halt */
+  bool *compiled;
+};
+
+/* Multiple values return in rax:rdx, chunk is 0 at the end of the program */
+struct jit_exit {
+  unsigned char *ptr;
+  uintptr_t chunk;
+};
+
+typedef struct jit_exit (*jit_lazy_fn)(unsigned char *ptr, const struct bf_io *io,
+                                       const uint8_t *entry);
+
+/* Chunk instruction i belongs to, nchunks for the final HALT */
+static uint32_t lazy_chunk_of(const struct jit_lazy *lz, uint32_t i) {
+  uint32_t lo = 0;
+  uint32_t hi = lz->nchunks + 1;
+
+  while (hi - lo > 1) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (lz->start[mid] <= i)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/* Where code jumping to the chunk starting at instruction i goes */
+static uint32_t lazy_entry(const struct jit_lazy *lz, uint32_t i) {
+  uint32_t c = lazy_chunk_of(lz, i);
+
+  if (c == lz->nchunks)
+    return lz->slot[c];
+  return LAZY_STUBS + c * LAZY_STUB_SIZE;
+}
+
+/*
+ * Bracket sizing pass. Loops are already in bottom-tested form: the test
+ * at '[' only guards entry, each iteration runs just the jnz at ']'.
+ * Jumping from '[' straight to the test instead measured slower, most
+ * loops run zero or one iterations per entry.
+ *
+ * x86 conditional jumps come in a 2 byte rel8 and a 6 byte rel32 form;
+ * which one fits depends on the size of the loop body, which in turn
+ * depends on the branches of the loops nested in it. Walking the program
+ * once with a stack of running body sizes settles the innermost loops
+ * first, so every bracket knows its encoding before code is emitted.
+ * Everything else is sized by emitting it into a scratch buffer, counted
+ * loops included.
+ *
+ * loops is indexed by instruction and filled in at each BF_OPEN of
+ * code[start..end). The brackets of split loops (lazy JIT) always take
+ * the rel32 form and are sized as such.
+ */
+static void jit_plan_loops(struct bf_program *prog, struct jit_loop *loops, uint32_t cell,
+                           uint32_t factor, const int64_t *trips, uint32_t start,
+                           uint32_t end) {
+  uint32_t *stack_open = NULL;
+  uint32_t *stack_size = NULL;
+  uint32_t stack_open_cap = 0;
+  uint32_t stack_size_cap = 0;
+  int depth = 0;
+  struct bf_cell_effect cells[BF_COUNTED_MAX_BODY];
+  struct jit_state scratch = { NULL, 0, 0, cell };
+  uint32_t test = cell_test_size(cell);
+
+  // per nesting level: index of the '[' and bytes emitted so far in its body
+  stack_size = (uint32_t *)grow_array(stack_size, &stack_size_cap, 1, sizeof(uint32_t));
+  stack_size[0] = 0;
+
+  for (uint32_t i = start; i < end; i++) {
+    struct bf_insn *insn = &prog->code[i];
+    uint32_t n;
+
+    switch(insn->op) {
+      case BF_OPEN:
+        if (loops[i].split) {
+          stack_size[depth] += test + 6;
+          break;
+        }
+
+        n = bf_counted_loop(prog->code, i, cell, cells);
+        if (n && (trips[i] != BF_TRIP_UNKNOWN || factor > 1)) {
+          loops[i].counted = true;
+          loops[i].trips = trips[i];
+          scratch.offset = 0;
+          jit_emit_counted(&scratch, prog, i, cells, n, trips[i], factor, NULL);
+          stack_size[depth] += scratch.offset;
+          i += insn->arg - 1;
+          break;
+        }
+
+        stack_open = (uint32_t *)grow_array(stack_open, &stack_open_cap, depth + 1, sizeof(uint32_t));
+        stack_size = (uint32_t *)grow_array(stack_size, &stack_size_cap, depth + 2, sizeof(uint32_t));
+        stack_open[depth] = i;
+        stack_size[++depth] = 0;
+        break;
+
+      case BF_CLOSE: {
+        if (loops[i + insn->arg - 1].split) {
+          stack_size[depth] += test + 6;
+          break;
+        }
+
+        uint32_t body = stack_size[depth--];
+        struct jit_loop *loop = &loops[stack_open[depth]];
+
+        // jnz lands on the first body instruction, jz right after the jnz
+        loop->short_close = body + test + 2 <= 128;
+        uint32_t close_size = test + (loop->short_close ? 2 : 6);
+        loop->short_open = body + close_size <= 127;
+        uint32_t open_size = test + (loop->short_open ? 2 : 6);
+
+        stack_size[depth] += open_size + body + close_size;
+        break;
+      }
+
+      default:
+        scratch.offset = 0;
+        jit_emit_insn(&scratch, insn);
+        stack_size[depth] += scratch.offset;
+        break;
+    }
+  }
+
+  free(scratch.buf);
+  free(stack_open);
+  free(stack_size);
+}
+
+static void jit_emit_prologue(struct jit_state *state) {
+  // push callee saved registers
+  emit_push(state, RBX);
+  emit_push(state, RBP);
+  emit_push(state, R12);
+  emit_push(state, R13);
+  emit_push(state, R14);
+  emit_push(state, R15);
+
+  // sub rsp, 8 ;keep the stack 16 byte aligned for the I/O calls
+  emit1(state, 0x48);
+  emit1(state, 0x83);
+  emit1(state, 0xec);
+  emit1(state, 0x08);
+
+  // mov rbx, rdi ;cell pointer
+  emit1(state, 0x48);
+  emit1(state, 0x89);
+  emit1(state, 0xfb);
+
+  // mov r12, rsi ;struct bf_io
+  emit1(state, 0x49);
+  emit1(state, 0x89);
+  emit1(state, 0xf4);
+
+  // jmp rdx ;the code of the first instruction to run
+  emit1(state, 0xff);
+  emit1(state, 0xe2);
+}
+
+static void jit_emit_epilogue(struct jit_state *state) {
+  // mov rax, rbx ;return the final cell pointer
+  emit1(state, 0x48);
+  emit1(state, 0x89);
+  emit1(state, 0xd8);
+
+  // add rsp, 8
+  emit1(state, 0x48);
+  emit1(state, 0x83);
+  emit1(state, 0xc4);
+  emit1(state, 0x08);
+
+  emit_pop(state, R15);
+  emit_pop(state, R14);
+  emit_pop(state, R13);
+  emit_pop(state, R12);
+  emit_pop(state, RBP);
+  emit_pop(state, RBX);
+
+  // ret
+  emit1(state, 0xc3);
+}
+
+/*
+ * Emit code[start..end) at state->offset, recording the code offset of
+ * every instruction in insn_off. Loops are whole within the range except
+ * split ones, whose brackets jump to the slots of the chunks right after
+ * the '[' and the ']' instead (see the lazy JIT below).
+ */
+static void jit_emit_range(struct jit_state *state, struct bf_program *prog,
+                           struct jit_loop *loops, uint32_t factor, uint32_t start,
+                           uint32_t end, uint32_t *insn_off, const struct jit_lazy *lazy) {
+  struct bf_cell_effect cells[BF_COUNTED_MAX_BODY];
+
+  // code offset of the jz emitted for each '[', by index from start
+  uint32_t *open_bracket_off = (uint32_t *)malloc((end - start + 1) * sizeof(uint32_t));
+  uint32_t open_br_off;
+  struct jit_loop *loop;
+
+  for (uint32_t i = start; i < end; i++) {
+    struct bf_insn *insn = &prog->code[i];
+
+    insn_off[i] = state->offset;
+
+    switch(insn->op) {
+      case BF_OPEN:
+        loop = &loops[i];
+
+        if (loop->counted) {
+          uint32_t n = bf_counted_loop(prog->code, i, state->cell, cells);
+          jit_emit_counted(state, prog, i, cells, n, loop->trips, factor, insn_off);
+          i += insn->arg - 1;
+          break;
+        }
+
+        jit_emit_test(state);
+
+        if (loop->split) {
+          jit_emit_jump(state, 0x84, lazy_entry(lazy, i + insn->arg));
+          break;
+        }
+
+        open_bracket_off[i - start] = state->offset;
+
+        if (loop->short_open) {
+          // jz rel8 0
+          emit1(state, 0x74);
+          emit1(state, 0x00);
+        }
+        else {
+          // jz rel32 0
+          emit1(state, 0x0f);
+          emit1(state, 0x84);
+          emit4(state, 0x00000000);
+        }
+        break;
+
+      case BF_CLOSE: {
+        uint32_t open = i + insn->arg - 1;
+        loop = &loops[open];
+
+        jit_emit_test(state);
+
+        if (loop->split) {
+          jit_emit_jump(state, 0x85, lazy_entry(lazy, open + 1));
+          break;
+        }
+
+        open_br_off = open_bracket_off[open - start];
+        uint32_t open_size = loop->short_open ? 2 : 6;
+        uint32_t close_size = loop->short_close ? 2 : 6;
+
+        uint32_t jmp_open_from = state->offset + close_size;
+        uint32_t jmp_open_to = open_br_off + open_size;
+        uint32_t jmp_open_off = compute_pc_rel32(jmp_open_from, jmp_open_to);
+
+        if (loop->short_close) {
+          // jnz rel8 jmp_open_off
+          assert(jmp_open_from - jmp_open_to <= 128);
+          emit1(state, 0x75);
+          emit1(state, jmp_open_off & 0xff);
+        }
+        else {
+          // jnz rel32 jmp_open_off
+          emit1(state, 0x0f);
+          emit1(state, 0x85);
+          emit4(state, jmp_open_off);
+        }
+
+        uint32_t jmp_close_from = open_br_off + open_size;
+        uint32_t jmp_close_to = state->offset;
+        uint32_t jmp_close_off = compute_pc_rel32(jmp_close_from, jmp_close_to);
+
+        // replace off
+        if (loop->short_open) {
+          assert(jmp_close_to - jmp_close_from <= 127);
+          replace_bytes(state->buf, open_br_off + 1, jmp_close_off, 1);
+        }
+        else {
+          replace_bytes(state->buf, open_br_off + 2, jmp_close_off, 4);
+        }
+        break;
+      }
+
+      default:
+        jit_emit_insn(state, insn);
+        break;
+    }
+  }
+
+  free(open_bracket_off);
+}
+
+/* A parallel JIT compile, one jit_state per region of the program */
+struct jit_regions {
+  struct bf_program *prog;
+  struct jit_loop *loops;
+  const int64_t *trips;
+  const uint32_t *bounds;
+  uint32_t *insn_off;
+  uint32_t factor;
+  struct jit_state *states;
+};
+
+/*
+ * Plan and emit region k into a buffer of its own, with insn_off relative
+ * to the start of the region. Regions share loops and insn_off, but each
+ * only ever touches the entries of its own instructions.
+ */
+static void jit_compile_region(void *ctx, uint32_t k) {
+  struct jit_regions *r = (struct jit_regions *)ctx;
+  uint32_t start = r->bounds[k];
+  uint32_t end = r->bounds[k + 1];
+
+  jit_plan_loops(r->prog, r->loops, r->states[k].cell, r->factor, r->trips, start, end);
+  jit_emit_range(&r->states[k], r->prog, r->loops, r->factor, start, end, r->insn_off, NULL);
+}
+
+/*
+ * Compile h->prog to x86-64. The generated function is
+ * unsigned char *fn(unsigned char *ptr, const struct bf_io *io,
+ * const uint8_t *entry) and returns the cell pointer it stopped at.
+ * entry is the code of the instruction to start at, code + insn_off[pc];
+ * any instruction is a valid entry point since nothing but rbx and r12
+ * is live between instructions.
+ *
+ * Big programs are compiled a region at a time on BF_JOBS threads (see
+ * bf_parallel.h). All branches stay within their region and are relative,
+ * so stitching the regions together only takes moving each one to its
+ * place after the prologue and rebasing the insn_off of its instructions.
+ */
+static int jit_compile(struct bf_handle *h) {
+  struct bf_program *prog = &h->prog;
+  struct jit_state state;
+  struct jit_regions r;
+  unsigned jobs = bf_jobs(BF_JOBS_COUNT(h->flags));
+  uint32_t *bounds;
+  uint32_t nregions = bf_regions(prog, jobs, &bounds);
+  int64_t *trips = (int64_t *)malloc((prog->len + 1) * sizeof(int64_t));
+
+  // known trip counts flow through the whole program, this pass stays serial
+  bf_known_trips(prog, h->cell, trips);
+  phase_end(h, "loops");
+
+  // code offset of every instruction, insn_off[prog->len] is the epilogue
+  r.prog = prog;
+  r.loops = (struct jit_loop *)calloc(prog->len + 1, sizeof(struct jit_loop));
+  r.trips = trips;
+  r.bounds = bounds;
+  r.insn_off = (uint32_t *)malloc((prog->len + 1) * sizeof(uint32_t));
+  r.factor = BF_UNROLL_FACTOR(h->flags);
+  r.states = (struct jit_state *)calloc(nregions, sizeof(struct jit_state));
+  for (uint32_t k = 0; k < nregions; k++)
+    r.states[k].cell = h->cell;
+
+  bf_parallel_for(nregions, jobs, jit_compile_region, &r);
+  free(r.loops);
+  free(trips);
+  phase_end(h, "codegen");
+
+  state.buf = (uint8_t *)malloc(JIT_INITIAL_SIZE);
+  state.size = JIT_INITIAL_SIZE;
+  state.offset = 0;
+  state.cell = h->cell;
+
+  jit_emit_prologue(&state);
+  for (uint32_t k = 0; k < nregions; k++) {
+    uint32_t base = state.offset;
+
+    for (uint32_t i = bounds[k]; i < bounds[k + 1]; i++)
+      r.insn_off[i] += base;
+    emit_bytes(&state, r.states[k].buf, r.states[k].offset);
+    free(r.states[k].buf);
+  }
+  free(r.states);
+  free(bounds);
+
+  uint32_t *insn_off = r.insn_off;
+  insn_off[prog->len] = state.offset;
+  jit_emit_epilogue(&state);
+  phase_end(h, "stitch");
+
+  /*
+   * W^X: the code is copied into a writable mapping which is then
+   * flipped to read+execute, it is never writable and executable at once.
+   */
+  size_t code_size = state.offset;
+  void *jitted_code = map_region(&code_size, h->flags & BF_HUGEPAGES);
+  if (!jitted_code) {
+    fprintf(stderr, "error: could not map code memory\n");
+    free(state.buf);
+    free(insn_off);
+    return -1;
+  }
+  memcpy(jitted_code, state.buf, state.offset);
+  free(state.buf);
+
+  if (mprotect(jitted_code, code_size, PROT_READ | PROT_EXEC) != 0) {
+    perror("mprotect");
+    munmap(jitted_code, code_size);
+    free(insn_off);
+    return -1;
+  }
+
+  h->code = (uint8_t *)jitted_code;
+  h->code_map_size = code_size;
+  h->code_size = state.offset;
+  h->insn_off = insn_off;
+  phase_end(h, "map");
+
+  return 0;
+}
+
+/*
+ * Cut h->prog into chunks and mark the loops whose bodies are chunks of
+ * their own as split. Loops that stay whole are skipped over, so the
+ * brackets seen here are all split ones.
+ */
+static void lazy_cut(struct jit_lazy *lz, struct bf_program *prog) {
+  struct bf_cell_effect cells[BF_COUNTED_MAX_BODY];
+  uint32_t cap = 0;
+  uint32_t cs = 0;
+  uint32_t depth = 0;
+
+  lz->nchunks = 0;
+  lz->start = NULL;
+
+  for (uint32_t i = 0; i < prog->len; ) {
+    struct bf_insn *insn = &prog->code[i];
+    uint32_t next = i + 1;
+    bool cut_before = false;
+    bool cut_after = false;
+
+    if (insn->op == BF_OPEN) {
+      uint32_t size = insn->arg;
+      bool counted = bf_counted_loop(prog->code, i, lz->cell, cells) &&
+                     (lz->trips[i] != BF_TRIP_UNKNOWN || lz->factor > 1);
+
+      if (!counted && (depth == 0 ? size >= LAZY_MIN_SPLIT : size > LAZY_CHUNK)) {
+        lz->loops[i].split = true;
+        depth++;
+        cut_after = true;
+      }
+      else {
+        next = i + size;
+        cut_before = next - cs > LAZY_CHUNK;
+      }
+    }
+    else if (insn->op == BF_CLOSE) {
+      depth--;
+      cut_after = true;
+    }
+    else {
+      cut_before = i - cs >= LAZY_CHUNK;
+    }
+
+    if (cut_before && i > cs) {
+      lz->start = (uint32_t *)grow_array(lz->start, &cap, lz->nchunks + 1, sizeof(uint32_t));
+      lz->start[lz->nchunks++] = cs;
+      cs = i;
+    }
+    if (cut_after) {
+      lz->start = (uint32_t *)grow_array(lz->start, &cap, lz->nchunks + 1, sizeof(uint32_t));
+      lz->start[lz->nchunks++] = cs;
+      cs = next;
+    }
+    i = next;
+  }
+
+  if (cs < prog->len) {
+    lz->start = (uint32_t *)grow_array(lz->start, &cap, lz->nchunks + 1, sizeof(uint32_t));
+    lz->start[lz->nchunks++] = cs;
+  }
+  lz->start = (uint32_t *)grow_array(lz->start, &cap, lz->nchunks + 1, sizeof(uint32_t));
+  lz->start[lz->nchunks] = prog->len;
+}
+
+static void lazy_free(struct jit_lazy *lz, size_t map_size) {
+  if (!lz)
+    return;
+
+  if (lz->rw)
+    munmap(lz->rw, map_size);
+  pthread_mutex_destroy(&lz->lock);
+  free(lz->loops);
+  free(lz->trips);
+  free(lz->start);
+  free(lz->slot);
+  free(lz->compiled);
+  free(lz);
+}
+
+/*
+ * Set up lazy compilation of h->prog: chunks, code memory with the
+ * prologue, the stubs and the halt. Nothing of the program itself is
+ * compiled yet, every instruction's insn_off is its chunk's slot.
+ */
+static int lazy_init(struct bf_handle *h) {
+  struct bf_program *prog = &h->prog;
+  struct jit_lazy *lz = (struct jit_lazy *)calloc(1, sizeof(struct jit_lazy));
+  struct jit_state state;
+
+  pthread_mutex_init(&lz->lock, NULL);
+  h->lazy = lz;
+
+  lz->cell = h->cell;
+  lz->factor = BF_UNROLL_FACTOR(h->flags);
+  lz->trips = (int64_t *)malloc((prog->len + 1) * sizeof(int64_t));
+  bf_known_trips(prog, lz->cell, lz->trips);
+  phase_end(h, "loops");
+  lz->loops = (struct jit_loop *)calloc(prog->len + 1, sizeof(struct jit_loop));
+  lazy_cut(lz, prog);
+  phase_end(h, "chunks");
+
+  lz->slot = (uint32_t *)malloc((lz->nchunks + 1) * sizeof(uint32_t));
+  lz->compiled = (bool *)calloc(lz->nchunks, sizeof(bool));
+
+  uint64_t off = (LAZY_STUBS + (uint64_t)lz->nchunks * LAZY_STUB_SIZE + 15) & ~15;
+  for (uint32_t c = 0; c < lz->nchunks; c++) {
+    lz->slot[c] = off;
+    off += (lz->start[c + 1] - lz->start[c]) * (uint64_t)LAZY_INSN_BYTES + 5;
+    off = (off + 15) & ~15;
+    if (off > UINT32_MAX - LAZY_HALT_SIZE) {
+      fprintf(stderr, "error: program too big for the JIT\n");
+      return -1;
+    }
+  }
+  lz->slot[lz->nchunks] = off;
+  off += LAZY_HALT_SIZE;
+
+  size_t map_size = (off + 4095) & ~(size_t)4095;
+  int fd = memfd_create("bf-jit", MFD_CLOEXEC);
+  if (fd < 0 || ftruncate(fd, map_size) != 0) {
+    fprintf(stderr, "error: could not map code memory\n");
+    if (fd >= 0)
+      close(fd);
+    return -1;
+  }
+
+  void *rw = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  void *rx = mmap(NULL, map_size, PROT_READ | PROT_EXEC, MAP_SHARED, fd, 0);
+  close(fd);
+  if (rw == MAP_FAILED || rx == MAP_FAILED) {
+    fprintf(stderr, "error: could not map code memory\n");
+    if (rw != MAP_FAILED)
+      munmap(rw, map_size);
+    if (rx != MAP_FAILED)
+      munmap(rx, map_size);
+    return -1;
+  }
+
+  phase_end(h, "map");
+
+  lz->rw = (uint8_t *)rw;
+  h->code = (uint8_t *)rx;
+  h->code_map_size = map_size;
+  h->code_size = off;
+
+  // the whole mapping is the buffer, the bounds above keep it from growing
+  state.buf = lz->rw;
+  state.size = off;
+  state.offset = 0;
+  state.cell = lz->cell;
+  jit_emit_prologue(&state);
+
+  uint32_t halt = lz->slot[lz->nchunks];
+  for (uint32_t c = 0; c < lz->nchunks; c++) {
+    state.offset = LAZY_STUBS + c * LAZY_STUB_SIZE;
+
+    // nop3 ; jmp rel32 to the trampoline
+    emit1(&state, 0x0f);
+    emit1(&state, 0x1f);
+    emit1(&state, 0x00);
+    jit_emit_jump(&state, 0xe9, state.offset + 5);
+
+    // mov edx, chunk + 1 ; jmp exit
+    emit1(&state, 0xba);
+    emit4(&state, c + 1);
+    jit_emit_jump(&state, 0xe9, halt + 2);
+  }
+
+  // xor edx, edx
+  state.offset = halt;
+  emit1(&state, 0x31);
+  emit1(&state, 0xd2);
+  jit_emit_epilogue(&state);
+
+  h->insn_off = (uint32_t *)malloc((prog->len + 1) * sizeof(uint32_t));
+  for (uint32_t c = 0; c <= lz->nchunks; c++) {
+    for (uint32_t i = lz->start[c]; i < (c < lz->nchunks ? lz->start[c + 1] : prog->len + 1); i++)
+      h->insn_off[i] = lz->slot[c];
+  }
+  phase_end(h, "stubs");
+
+  return 0;
+}
+
+/* Compile chunk c unless some run already has, and point its stub at it */
+static void lazy_compile(const struct bf_handle *h, uint32_t c) {
+  struct jit_lazy *lz = h->lazy;
+  struct bf_program *prog = (struct bf_program *)&h->prog;
+  struct jit_state state;
+
+  pthread_mutex_lock(&lz->lock);
+  if (lz->compiled[c]) {
+    pthread_mutex_unlock(&lz->lock);
+    return;
+  }
+
+  uint32_t start = lz->start[c];
+  uint32_t end = lz->start[c + 1];
+
+  state.buf = lz->rw;
+  state.size = lz->slot[c + 1];
+  state.offset = lz->slot[c];
+  state.cell = lz->cell;
+
+  jit_plan_loops(prog, lz->loops, lz->cell, lz->factor, lz->trips, start, end);
+  jit_emit_range(&state, prog, lz->loops, lz->factor, start, end, h->insn_off, lz);
+  jit_emit_jump(&state, 0xe9, lazy_entry(lz, end));
+  assert(state.buf == lz->rw && state.offset <= lz->slot[c + 1]);
+
+  uint32_t stub = LAZY_STUBS + c * LAZY_STUB_SIZE + LAZY_STUB_JMP;
+  __atomic_store_n((uint32_t *)(lz->rw + stub + 1),
+                   compute_pc_rel32(stub + 5, lz->slot[c]), __ATOMIC_RELEASE);
+  lz->compiled[c] = true;
+
+  pthread_mutex_unlock(&lz->lock);
+}
+
+/* Run from instruction pc, compiling chunks as the program gets to them */
+static void lazy_run(const struct bf_handle *h, unsigned char *ptr, uint32_t pc,
+                     const struct bf_io *io) {
+  struct jit_lazy *lz = h->lazy;
+  jit_lazy_fn fn = (jit_lazy_fn)h->code;
+  uint32_t c = lazy_chunk_of(lz, pc);
+
+  if (c < lz->nchunks)
+    lazy_compile(h, c);
+
+  const uint8_t *entry = h->code + h->insn_off[pc];
+  for (;;) {
+    struct jit_exit ex = fn(ptr, io, entry);
+    if (!ex.chunk)
+      return;
+
+    c = ex.chunk - 1;
+    lazy_compile(h, c);
+    ptr = ex.ptr;
+    entry = h->code + lz->slot[c];
+  }
+}
+
+struct trace_run {
+  const struct bf_insn *code;
+  unsigned char *tape;
+  size_t tape_size;
+  struct trace_slot *loops;
+  struct trace_slot *sides;
+  struct trace rec;
+};
+
+static void trace_free_slots(struct trace_slot *slots, uint32_t len) {
+  for (uint32_t k = 0; k <= len; k++) {
+    if (slots[k].fn)
+      munmap((void *)slots[k].fn, slots[k].map_size);
+    free(slots[k].exits);
+    free(slots[k].sides);
+  }
+  free(slots);
+}
+
+#define CELL uint8_t
+#define CELL_FN(name) name##_8
+#include "bf_engines.h"
+#define CELL uint16_t
+#define CELL_FN(name) name##_16
+#include "bf_engines.h"
+#define CELL uint32_t
+#define CELL_FN(name) name##_32
+#include "bf_engines.h"
+
+/* Call the instance of an engine for a cell width */
+#define CELL_DISPATCH(cell, name, ...)      \
+  ((cell) == 4 ? name##_32(__VA_ARGS__) :   \
+   (cell) == 2 ? name##_16(__VA_ARGS__) :   \
+   name##_8(__VA_ARGS__))
+
+bf_handle *bf_compile_program(struct bf_program *prog, int engine, unsigned flags) {
+  bf_handle *h = (bf_handle *)calloc(1, sizeof(bf_handle));
+
+  h->engine = engine;
+  h->flags = flags;
+  h->cell = BF_CELL_BYTES(flags);
+  if (flags & BF_TIME_PHASES)
+    bf_phases_start(&h->phases);
+  h->prog = *prog;
+  h->checksum = bf_checksum(prog->code, (prog->len + 1) * sizeof(struct bf_insn));
+  phase_end(h, "checksum");
+
+  if (engine == BF_ENGINE_JIT) {
+    if ((flags & BF_LAZY ? lazy_init(h) : jit_compile(h)) != 0) {
+      bf_free(h);
+      return NULL;
+    }
+  }
+  else if (engine == BF_ENGINE_INTERP) {
+    // thread a copy, the opcodes stay readable for snapshots and tools
+    size_t size = (prog->len + 1) * sizeof(struct bf_insn);
+    h->threaded = (struct bf_insn *)malloc(size);
+    memcpy(h->threaded, prog->code, size);
+    CELL_DISPATCH(h->cell, thread_code, h->threaded);
+    phase_end(h, "thread");
+  }
+
+  return h;
+}
+
+static int parse_flags(unsigned flags) {
+  return BF_PARSE_IDIOMS | (flags & BF_POSITIONS ? BF_PARSE_POSITIONS : 0);
+}
+
+bf_handle *bf_compile(const char *src, size_t len, int engine, unsigned flags) {
+  struct bf_program prog;
+
+  if (bf_parse((const unsigned char *)src, len, parse_flags(flags), &prog) != 0)
+    return NULL;
+
+  return bf_compile_program(&prog, engine, flags);
+}
+
+bf_handle *bf_compile_file(const char *path, int engine, unsigned flags) {
+  struct bf_program prog;
+
+  int rv = bf_load_bytecode(path, &prog);
+  if (rv == -2)
+    rv = bf_load_source(path, parse_flags(flags), &prog);
+  if (rv != 0)
+    return NULL;
+
+  return bf_compile_program(&prog, engine, flags);
+}
+
+/*
+ * JIT code can only be entered where an instruction has code of its own,
+ * which is not the case inside a folded counted loop: those instructions
+ * share the offset of the loop's '[' (see jit_emit_counted). A pc in
+ * there, only ever from a snapshot, is interpreted to the end of the loop,
+ * which has no loop nested in it, and *ptr_off and *pc move on with it.
+ */
+static int jit_leave_folded(const bf_handle *h, unsigned char *tape, size_t tape_size,
+                            size_t *ptr_off, uint32_t *pc, const struct bf_io *io) {
+  const struct bf_insn *code = h->prog.code;
+  uint64_t steps;
+
+  for (uint32_t j = *pc; j-- > 0; ) {
+    if (code[j].op == BF_CLOSE)
+      return BF_OK;
+    if (code[j].op == BF_OPEN) {
+      uint32_t close = j + code[j].arg - 1;
+
+      if (close < *pc || h->insn_off[j] != h->insn_off[*pc])
+        return BF_OK;
+      return CELL_DISPATCH(h->cell, interp_until, code, tape, tape_size, ptr_off, pc, &steps,
+                           0, 0, close + 1, io);
+    }
+  }
+
+  return BF_OK;
+}
+
+/* Run h on tape from instruction pc with the cell pointer at cell ptr_off */
+static int run_from(const bf_handle *h, unsigned char *tape, size_t tape_size,
+                    size_t ptr_off, uint32_t pc, const struct bf_io *io) {
+  if (!io)
+    io = &stdio_io;
+
+  if (h->engine == BF_ENGINE_JIT && pc) {
+    int rv;
+
+    // the chunk has to be there to tell whether pc has code
+    if (h->lazy && lazy_chunk_of(h->lazy, pc) < h->lazy->nchunks)
+      lazy_compile(h, lazy_chunk_of(h->lazy, pc));
+    rv = jit_leave_folded(h, tape, tape_size, &ptr_off, &pc, io);
+    if (rv != BF_OK)
+      return rv;
+  }
+
+  if (h->lazy) {
+    lazy_run(h, tape + ptr_off * h->cell, pc, io);
+    return BF_OK;
+  }
+
+  if (h->engine == BF_ENGINE_JIT) {
+    jit_fn fn = (jit_fn)h->code;
+    fn(tape + ptr_off * h->cell, io, h->code + h->insn_off[pc]);
+    return BF_OK;
+  }
+
+  if (h->engine == BF_ENGINE_TRACE)
+    return CELL_DISPATCH(h->cell, interp_trace, h, tape, tape_size, ptr_off, pc, io);
+
+  return CELL_DISPATCH(h->cell, interp_threaded, h->threaded, h->prog.code[pc].op, tape, tape_size,
+                       ptr_off, pc, io);
+}
+
+int bf_run(const bf_handle *h, unsigned char *tape, size_t tape_size,
+           const struct bf_io *io) {
+  return run_from(h, tape, tape_size, 0, 0, io);
+}
+
+int bf_snapshot_save(const bf_handle *h, const char *path, size_t tape_size,
+                     unsigned stop, uint64_t max_steps, const struct bf_io *io) {
+  struct bf_snap_header hdr;
+  char pad[BF_SNAP_TAPE_OFFSET - sizeof(struct bf_snap_header)];
+  size_t ptr = 0;
+  uint32_t pc = 0;
+  uint64_t steps;
+
+  if (!io)
+    io = &stdio_io;
+
+  unsigned char *tape = bf_tape_alloc(&tape_size, 0);
+  if (!tape)
+    return BF_ERR_SNAPSHOT;
+
+  int rv = CELL_DISPATCH(h->cell, interp_until, h->prog.code, tape, tape_size, &ptr, &pc, &steps,
+                         stop, max_steps, UINT32_MAX, io);
+  if (rv != BF_OK) {
+    bf_tape_free(tape, tape_size);
+    return rv;
+  }
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, BF_SNAP_MAGIC, 4);
+  hdr.version = BF_SNAP_VERSION;
+  hdr.program_checksum = h->checksum;
+  hdr.tape_size = tape_size;
+  hdr.ptr = ptr;
+  hdr.steps = steps;
+  hdr.pc = pc;
+  hdr.cell = h->cell;
+  memset(pad, 0, sizeof(pad));
+
+  FILE *f = fopen(path, "wb");
+  if (!f) {
+    bf_tape_free(tape, tape_size);
+    return BF_ERR_SNAPSHOT;
+  }
+
+  if (fwrite(&hdr, sizeof(hdr), 1, f) != 1 ||
+      fwrite(pad, sizeof(pad), 1, f) != 1 ||
+      fwrite(tape, tape_size, 1, f) != 1)
+    rv = BF_ERR_SNAPSHOT;
+  if (fclose(f) != 0)
+    rv = BF_ERR_SNAPSHOT;
+
+  bf_tape_free(tape, tape_size);
+  return rv;
+}
+
+/*
+ * The tape is not read into memory: the file is mapped copy-on-write at
+ * the page-aligned tape offset and the run works on that mapping, so only
+ * the pages the rest of the program touches are ever read.
+ */
+bf_snapshot *bf_snapshot_open(const bf_handle *h, const char *path) {
+  struct stat st;
+  struct bf_snap_header hdr;
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < BF_SNAP_TAPE_OFFSET) {
+    close(fd);
+    return NULL;
+  }
+
+  void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return NULL;
+
+  memcpy(&hdr, map, sizeof(hdr));
+  if (memcmp(hdr.magic, BF_SNAP_MAGIC, 4) != 0 || hdr.version != BF_SNAP_VERSION ||
+      hdr.program_checksum != h->checksum || hdr.pc > h->prog.len ||
+      hdr.tape_size > (uint64_t)st.st_size - BF_SNAP_TAPE_OFFSET ||
+      hdr.cell != h->cell || hdr.ptr >= hdr.tape_size / hdr.cell) {
+    munmap(map, st.st_size);
+    return NULL;
+  }
+
+  bf_snapshot *snap = (bf_snapshot *)calloc(1, sizeof(bf_snapshot));
+  snap->map = map;
+  snap->map_size = st.st_size;
+  snap->tape = (unsigned char *)map + BF_SNAP_TAPE_OFFSET;
+  snap->tape_size = hdr.tape_size;
+  snap->ptr = hdr.ptr;
+  snap->pc = hdr.pc;
+
+  return snap;
+}
+
+int bf_resume(const bf_handle *h, bf_snapshot *snap, const struct bf_io *io) {
+  return run_from(h, snap->tape, snap->tape_size, snap->ptr, snap->pc, io);
+}
+
+void bf_snapshot_close(bf_snapshot *snap) {
+  if (!snap)
+    return;
+
+  munmap(snap->map, snap->map_size);
+  free(snap);
+}
+
+void bf_free(bf_handle *h) {
+  if (!h)
+    return;
+
+  if (h->code)
+    munmap(h->code, h->code_map_size);
+  lazy_free(h->lazy, h->code_map_size);
+  free(h->insn_off);
+  free(h->threaded);
+  bf_program_free(&h->prog);
+  free(h);
+}
+
+unsigned char *bf_tape_alloc(size_t *size, unsigned flags) {
+  return (unsigned char *)map_region(size, flags & BF_HUGEPAGES);
+}
+
+void bf_tape_free(unsigned char *tape, size_t size) {
+  munmap(tape, size);
+}
+
+const struct bf_phases *bf_handle_phases(const bf_handle *h) {
+  return &h->phases;
+}
+
+const struct bf_program *bf_handle_program(const bf_handle *h) {
+  return &h->prog;
+}
+
+const uint8_t *bf_handle_code(const bf_handle *h, uint32_t *code_size,
+                              const uint32_t **insn_off) {
+  if (code_size)
+    *code_size = h->code_size;
+  if (insn_off)
+    *insn_off = h->insn_off;
+  return h->code;
+}
@@ -0,0 +1,174 @@
+#ifndef BRAINFUSED_H
+#define BRAINFUSED_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * libbrainfused: compile a BF program once into a handle, run it as many
+ * times as needed, from as many threads as needed.
+ *
+ * A handle is immutable once bf_compile returns. Every run gets its tape
+ * and I/O from the caller, so runs of the same handle never share state.
+ * All memory belonging to a handle is released by bf_free. The one
+ * exception is BF_LAZY code, which the runs add to as they go; that is
+ * serialized inside the handle and runs stay safe to start concurrently.
+ */
+
+/* Engines */
+#define BF_ENGINE_INTERP 0   /* direct-threaded interpreter, bounds checked */
+#define BF_ENGINE_JIT 1      /* x86-64 machine code, no bounds checks */
+#define BF_ENGINE_TRACE 2    /* interpreter + traces of hot loops, bounds checked */
+
+/* Compile flags */
+#define BF_HUGEPAGES 1       /* back JIT code with 2 MiB pages */
+#define BF_POSITIONS 2       /* keep source positions, for profiling */
+#define BF_LAZY 4            /* JIT: compile each part of the program on first entry,
+                                code is not backed by huge pages */
+#define BF_CELL16 8          /* 16 bit cells instead of 8 */
+#define BF_CELL32 16         /* 32 bit cells */
+#define BF_TIME_PHASES 32    /* time the phases of the compile, see bf_handle_phases */
+
+/* Cell width in bytes for the compile flags */
+#define BF_CELL_BYTES(flags) ((flags) & BF_CELL32 ? 4 : (flags) & BF_CELL16 ? 2 : 1)
+
+/*
+ * JIT unroll factor for counted loops whose trip count is only known at
+ * run time, a power of two up to 128, in the high bits of the flags. No
+ * BF_UNROLL at all means BF_DEFAULT_UNROLL, 1 is off. Loops with a trip
+ * count known at compile time are always folded completely.
+ */
+#define BF_UNROLL_SHIFT 8
+#define BF_UNROLL(n) ((unsigned)(n) << BF_UNROLL_SHIFT)
+#define BF_DEFAULT_UNROLL 1
+#define BF_UNROLL_FACTOR(flags) \
+  (((flags) >> BF_UNROLL_SHIFT) & 0xff ? ((flags) >> BF_UNROLL_SHIFT) & 0xff : BF_DEFAULT_UNROLL)
+
+/*
+ * Threads for the eager JIT to compile big programs with, in bits 16-23
+ * of the flags: BF_JOBS(1) compiles on the calling thread only, no
+ * BF_JOBS at all uses one thread per online CPU. Only programs of more
+ * than a few thousand instructions are split up at all.
+ */
+#define BF_JOBS_SHIFT 16
+#define BF_JOBS(n) ((unsigned)(n) << BF_JOBS_SHIFT)
+#define BF_JOBS_COUNT(flags) (((flags) >> BF_JOBS_SHIFT) & 0xff)
+
+/* Run results */
+#define BF_OK 0
+#define BF_ERR_TAPE_OVERFLOW -1
+#define BF_ERR_TAPE_UNDERFLOW -2
+#define BF_ERR_SNAPSHOT -3
+
+/* Snapshot stop points */
+#define BF_STOP_INPUT 1      /* before the first ',' */
+
+#define BF_DEFAULT_TAPE_SIZE 1048576
+
+typedef struct bf_handle bf_handle;
+typedef struct bf_snapshot bf_snapshot;
+
+/*
+ * Byte I/O for ',' and '.'. read returns the next input byte or -1 at end
+ * of input, which stores all ones (0xff, 0xffff, ...) in the cell. write
+ * gets the whole cell; the built-in I/O writes its low 8 bits.
+ */
+struct bf_io {
+  int (*read)(void *ctx);
+  void (*write)(void *ctx, int c);
+  void *ctx;
+};
+
+/* In-memory I/O: reads from in, writes to out, drops output past out_size */
+struct bf_buffers {
+  const unsigned char *in;
+  size_t in_size;
+  size_t in_pos;
+  unsigned char *out;
+  size_t out_size;
+  size_t out_len;
+};
+
+/*
+ * Compile len bytes of BF source. Returns NULL if the program does not
+ * parse or code memory could not be mapped.
+ */
+bf_handle *bf_compile(const char *src, size_t len, int engine, unsigned flags);
+
+/* Compile a .bf source file or a bfc --bytecode file */
+bf_handle *bf_compile_file(const char *path, int engine, unsigned flags);
+
+/*
+ * Run a compiled program on tape, tape_size bytes, starting at cell 0.
+ * Cells are 1, 2 or 4 bytes as compiled (BF_CELL16, BF_CELL32), native
+ * byte order; a tape_size that is not a multiple only wastes the rest.
+ * The caller clears the tape. A NULL io uses stdin/stdout.
+ *
+ * With BF_ENGINE_JIT the program must stay within the tape; the
+ * interpreter reports BF_ERR_TAPE_* instead.
+ */
+int bf_run(const bf_handle *h, unsigned char *tape, size_t tape_size,
+           const struct bf_io *io);
+
+void bf_free(bf_handle *h);
+
+/*
+ * Snapshots skip an input-independent warmup: bf_snapshot_save runs the
+ * program on a fresh tape of tape_size bytes until the stop point, the
+ * first ',' with BF_STOP_INPUT and/or max_steps instructions (0: no
+ * limit), and writes the tape, cell pointer and instruction to path.
+ * Output produced on the way goes to io.
+ *
+ * A snapshot belongs to the program it was taken from, not the engine:
+ * it can be resumed by any handle compiled from the same source.
+ * bf_snapshot_open returns NULL if the file is not a snapshot of h's
+ * program with h's cell width. The tape is mapped copy-on-write from
+ * the file, so the file is never modified; resuming consumes the
+ * snapshot, open it again for another run.
+ */
+int bf_snapshot_save(const bf_handle *h, const char *path, size_t tape_size,
+                     unsigned stop, uint64_t max_steps, const struct bf_io *io);
+bf_snapshot *bf_snapshot_open(const bf_handle *h, const char *path);
+int bf_resume(const bf_handle *h, bf_snapshot *snap, const struct bf_io *io);
+void bf_snapshot_close(bf_snapshot *snap);
+
+/* I/O over stdin/stdout, and over a struct bf_buffers passed as ctx */
+void bf_io_stdio(struct bf_io *io);
+void bf_io_buffers(struct bf_io *io, struct bf_buffers *bufs);
+
+/*
+ * Zeroed tape of at least *size bytes, *size is updated to the mapped
+ * size. With BF_HUGEPAGES it is backed by 2 MiB pages where possible.
+ */
+unsigned char *bf_tape_alloc(size_t *size, unsigned flags);
+void bf_tape_free(unsigned char *tape, size_t size);
+
+/*
+ * For the tools built on the library, which parse with bf_insn.h
+ * themselves: compile an already parsed program (the handle takes it
+ * over), and get back the program and, for the JIT, the machine code and
+ * the offset of the code of every instruction (insn_off[len] is the
+ * epilogue) for perf symbols and sampling.
+ */
+struct bf_program;
+bf_handle *bf_compile_program(struct bf_program *prog, int engine, unsigned flags);
+const struct bf_program *bf_handle_program(const bf_handle *h);
+const uint8_t *bf_handle_code(const bf_handle *h, uint32_t *code_size,
+                              const uint32_t **insn_off);
+
+/*
+ * With BF_TIME_PHASES, the time and memory of each phase of
+ * bf_compile_program (bf_phases.h); no phases without it.
+ */
+struct bf_phases;
+const struct bf_phases *bf_handle_phases(const bf_handle *h);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,33 @@
+/*
+ * A bytecode file whose brackets point at each other but cross,
+ * [1 [2 ]1 ]2, must be rejected as corrupt when it is loaded.
+ */
+#include "../bf_insn.h"
+
+int main(void) {
+  struct bf_insn code[] = {
+    { .op = BF_OPEN, .arg = 3 },
+    { .op = BF_OPEN, .arg = 3 },
+    { .op = BF_CLOSE, .arg = -1 },
+    { .op = BF_CLOSE, .arg = -1 },
+    { .op = HALT },
+  };
+  struct bf_program prog = { .code = code, .len = 4 };
+  const char *path = "tests/crossing_brackets.bfbc";
+  FILE *f = fopen(path, "wb");
+
+  if (!f || bf_write_bytecode(f, &prog, 0) != 0) {
+    printf("FAIL: could not write %s\n", path);
+    return 1;
+  }
+  fclose(f);
+
+  int rv = bf_load_bytecode(path, &prog);
+  remove(path);
+  if (rv != -3) {
+    printf("FAIL: crossing brackets loaded with %d, expected -3\n", rv);
+    return 1;
+  }
+
+  return 0;
+}